@@ -64,16 +64,33 @@ void image_decode_4bpp(
     const Palette4& palette,
     std::vector<Pixel>& pixels
 )
+{
+    image_decode_4bpp(source.data(), source.size(), palette, pixels);
+}
+
+/**
+ * @brief Convert a region of raw bytes into a list of pixels (RGB).
+ * @param[in]   source  Start of the raw data, e.g. a slice of a VRAM image.
+ * @param[in]   len     Length of the raw data in bytes.
+ * @param[in]   palette List of pixels used to look up the correct color.
+ * @param[out]  pixels  Resulting array of pixels.
+ */
+void image_decode_4bpp(
+    const uint8_t* source,
+    size_t len,
+    const Palette4& palette,
+    std::vector<Pixel>& pixels
+)
 {
     // First determine how many Pixels there will be to allocate space
     // in the output vector.
     // Each byte is 2 pixels, so reserve a space twice the size of the source buffer.
-    pixels.reserve(2 * source.size());
+    pixels.reserve(2 * len);
 
     // Used as the lookup index into the palette. Range 0-15
     uint8_t nibble;
 
-    for (size_t i = 0; i < source.size(); ++i) {
+    for (size_t i = 0; i < len; ++i) {
 
         // In 16-color mode (4bpp mode) each group of 4 bits represents
         // a single pixel. The 4 bits are used as an index into the palette
@@ -46,6 +46,20 @@ void image_decode_4bpp(
     std::vector<Pixel>& pixels
 );
 
+/**
+ * @brief Convert a region of raw bytes into a list of pixels (RGB).
+ * @param[in]   source  Start of the raw data, e.g. a slice of a VRAM image.
+ * @param[in]   len     Length of the raw data in bytes.
+ * @param[in]   palette List of pixels used to look up the correct color.
+ * @param[out]  pixels  Resulting array of pixels.
+ */
+void image_decode_4bpp(
+    const uint8_t* source,
+    size_t len,
+    const Palette4& palette,
+    std::vector<Pixel>& pixels
+);
+
 /**
  * @brief Convert a list of Pixels into a bitmap.
  * @param[in]   pixels      Array of pixels
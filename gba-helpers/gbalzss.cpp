@@ -27,524 +27,3812 @@
  */
 
 #include "gbalzss.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GBALZSS_X86 1
+#include <immintrin.h>
+#endif
 
 namespace gbalzss
 {
 
-/** @brief Find last instance of a byte in a buffer
- *  @param[in] first Beginning of buffer
- *  @param[in] last  End of buffer
- *  @param[in] val   Byte to find
- *
- *  @returns iterator to found byte
- *  @retval last if no match found
+namespace
+{
+
+/** @brief Common prefix length, one machine word at a time
+ *  @param[in] a   First string
+ *  @param[in] b   Second string
+ *  @param[in] len Maximum length to compare
+ *  @returns Length of common prefix
  */
-Buffer::const_iterator
-rfind(Buffer::const_iterator first, Buffer::const_iterator last,
-      const uint8_t &val)
+inline size_t
+match_length_word(const uint8_t *a, const uint8_t *b, size_t len)
 {
-  assert(last >= first);
+  size_t n = 0;
 
-  auto it = last;
-  while(--it >= first)
+#if defined(__GNUC__)
+  for(; n + 8 <= len; n += 8)
   {
-    if(*it == val)
-      return it;
+    uint64_t x, y;
+    std::memcpy(&x, a + n, 8);
+    std::memcpy(&y, b + n, 8);
+
+    // the first differing bit locates the first differing byte
+    if(uint64_t diff = x ^ y)
+    {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return n + __builtin_ctzll(diff) / 8;
+#else
+      return n + __builtin_clzll(diff) / 8;
+#endif
+    }
   }
+#endif
 
-  return last;
+  while(n < len && a[n] == b[n])
+    ++n;
+
+  return n;
 }
 
-/** @brief Find best buffer match
- *  @param[in]  source   Source buffer
- *  @param[in]  it       Position in source buffer
- *  @param[in]  len      Maximum length to match
- *  @param[in]  max_disp Maximum displacement
- *  @param[in]  vram     VRAM-safe
- *  @param[out] outlen   Length of match
- *  @returns Iterator to best match
- *  @retval source.cend() for no match
+#ifdef GBALZSS_X86
+/** @brief Common prefix length, 16 bytes at a time
+ *  @param[in] a   First string
+ *  @param[in] b   Second string
+ *  @param[in] len Maximum length to compare
+ *  @returns Length of common prefix
  */
-Buffer::const_iterator
-find_best_match(const Buffer &source, Buffer::const_iterator it, size_t len,
-                size_t max_disp, bool vram, size_t &outlen)
+__attribute__((target("sse2"))) size_t
+match_length_sse2(const uint8_t *a, const uint8_t *b, size_t len)
 {
-  auto begin = source.cbegin();
-  auto end   = source.cend();
+  size_t n = 0;
+  for(; n + 16 <= len; n += 16)
+  {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + n));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + n));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+    if(mask)
+      return n + __builtin_ctz(mask);
+  }
 
-  assert(it > source.cbegin());
-  assert(it < source.cend());
+  return n + match_length_word(a + n, b + n, len - n);
+}
 
-  // clamp start to maximum displacement from buffer
-  if(it - begin > static_cast<ptrdiff_t>(max_disp))
-    begin = it - max_disp;
+/** @brief Common prefix length, 32 bytes at a time
+ *  @param[in] a   First string
+ *  @param[in] b   Second string
+ *  @param[in] len Maximum length to compare
+ *  @returns Length of common prefix
+ */
+__attribute__((target("avx2"))) size_t
+match_length_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+  size_t n = 0;
+  for(; n + 32 <= len; n += 32)
+  {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + n));
+    __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + n));
+    unsigned mask = ~static_cast<unsigned>(
+                      _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+    if(mask)
+      return n + __builtin_ctz(mask);
+  }
 
-  // clamp len to end of buffer
-  if(end - it < static_cast<ptrdiff_t>(len))
-    len = end - it;
+  return n + match_length_sse2(a + n, b + n, len - n);
+}
+#endif
 
-  auto   best_start = it;
-  size_t best_len = 0;
+/** @brief Common prefix length implementation */
+typedef size_t (*MatchLengthFn)(const uint8_t*, const uint8_t*, size_t);
 
-  // find nearest matching start byte
-  auto last_p = it;
-  auto p = rfind(begin, last_p, *it);
-  while(p != last_p)
+/** @brief Select the widest common prefix kernel this CPU supports
+ *  @returns Common prefix length implementation
+ */
+MatchLengthFn
+select_match_length()
+{
+#ifdef GBALZSS_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return match_length_avx2;
+  if(__builtin_cpu_supports("sse2"))
+    return match_length_sse2;
+#endif
+
+  return match_length_word;
+}
+
+/** @brief Common prefix length kernel selected at startup */
+const MatchLengthFn match_length_impl = select_match_length();
+
+/** @brief Hash chain table size (log2) */
+const unsigned HASH_BITS = 16;
+
+/** @brief Hash chain terminator */
+const uint32_t HASH_NIL = UINT32_MAX;
+
+/** @brief Hash a 3-byte prefix
+ *  @param[in] p Pointer to prefix
+ *  @returns Hash table index
+ */
+inline uint32_t
+hash3(const uint8_t *p)
+{
+  uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/** @brief Matches found for the most recently searched positions
+ *
+ *  The lazy lookahead in lzss_encode() searches the two positions where the
+ *  next token can start, so remembering the last few searches means no
+ *  position is ever searched twice.
+ */
+class MatchCache
+{
+public:
+  /** @brief Look up a position
+   *  @param[in]  it     Position in source buffer
+   *  @param[out] match  Best match
+   *  @param[out] outlen Length of match
+   *  @returns Whether the position was cached
+   */
+  bool lookup(Buffer::const_iterator it, Buffer::const_iterator &match,
+              size_t &outlen) const
   {
-    // find length of match
-    size_t test_len = 1;
-    for(size_t i = 1; i < len; ++i)
+    for(const Entry &entry: entries)
+    {
+      if(entry.valid && entry.it == it)
+      {
+        match  = entry.match;
+        outlen = entry.len;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /** @brief Remember a search result, replacing the oldest
+   *  @param[in] it    Position in source buffer
+   *  @param[in] match Best match
+   *  @param[in] len   Length of match
+   */
+  void store(Buffer::const_iterator it, Buffer::const_iterator match,
+             size_t len)
+  {
+    Entry &entry = entries[next];
+    entry.valid = true;
+    entry.it    = it;
+    entry.match = match;
+    entry.len   = len;
+    next = (next + 1) % SIZE;
+  }
+
+private:
+  /** @brief Number of cached positions */
+  static const size_t SIZE = 4;
+
+  /** @brief Cached search */
+  struct Entry
+  {
+    bool                   valid = false; ///< Whether entry is in use
+    Buffer::const_iterator it;            ///< Searched position
+    Buffer::const_iterator match;         ///< Best match
+    size_t                 len = 0;       ///< Length of match
+  };
+
+  Entry  entries[SIZE]; ///< Cached searches
+  size_t next = 0;      ///< Next entry to replace
+};
+
+/** @brief Compressed token writer
+ *
+ *  Appends literal and match tokens to an output region, inserting a flag
+ *  byte before every group of eight tokens.
+ */
+class TokenWriter
+{
+public:
+  /** @brief Constructor
+   *  @param[in] buffer Output region
+   *  @param[in] size   Output region size
+   *  @param[in] pos    Position of the first token
+   *  @param[in] mode   LZ mode
+   */
+  TokenWriter(uint8_t *buffer, size_t size, size_t pos, LZSS_t mode)
+  : buffer(buffer),
+    size(size),
+    pos(pos),
+    mode(mode),
+    code_pos(pos),
+    shift(8)
+  {
+    // reserve an encode byte in output buffer
+    push_back(0);
+  }
+
+  /** @brief Append an uncompressed byte
+   *  @param[in] value Byte to copy
+   */
+  void literal(uint8_t value)
+  {
+    next();
+
+    // this is a copy chunk; append this byte to the output buffer
+    push_back(value);
+  }
+
+  /** @brief Append a compressed block
+   *  @param[in] len  Match length
+   *  @param[in] disp Match displacement
+   */
+  void match(size_t len, size_t disp)
+  {
+    next();
+
+    // mark this chunk as compressed
+    assert(code_pos < pos);
+    buffer[code_pos] |= (1 << shift);
+
+    // encode the displacement and length
+    assert(disp >= 1);
+    assert(disp - 1 <= 0xFFF);
+    --disp;
+
+    if(mode == LZ10)
+    {
+      assert(len >= 3);
+      assert(len-3 <= 0xF);
+      push_back(((len-3) << 4) | (disp >> 8));
+      push_back(disp);
+    }
+    else if(len <= 0x10)
+    {
+      assert(len > 2);
+      assert(len-1 <= 0xF);
+      push_back(((len-1) << 4) | (disp >> 8));
+      push_back(disp);
+    }
+    else if(len <= 0x110)
+    {
+      assert(len >= 0x11);
+      assert(len-0x11 <= 0xFF);
+      push_back((len-0x11) >> 4);
+      push_back(((len-0x11) << 4) | (disp >> 8));
+      push_back(disp);
+    }
+    else
+    {
+      assert(len >= 0x111);
+      assert(len-0x111 <= 0xFFFF);
+      push_back((1 << 4) | (len-0x111) >> 12);
+      push_back(((len-0x111) >> 4));
+      push_back(((len-0x111) << 4) | (disp >> 8));
+      push_back(disp);
+    }
+  }
+
+  /** @brief Pad the output buffer to 4 bytes
+   *  @returns Output length
+   */
+  size_t finish()
+  {
+    while(pos & 0x3)
+      push_back(0);
+
+    return pos;
+  }
+
+  /** @brief Length of the completed output
+   *
+   *  Everything before the current flag byte is final; the flag byte and the
+   *  tokens following it may still change.
+   */
+  size_t complete() const
+  {
+    return code_pos;
+  }
+
+  /** @brief Drop completed output from the front of the region
+   *  @param[in] len Bytes to drop (a multiple of 4, at most complete())
+   */
+  void discard(size_t len)
+  {
+    // keep the padding aligned to the start of the stream
+    assert(len <= code_pos);
+    assert(!(len & 0x3));
+
+    std::memmove(buffer, buffer + len, pos - len);
+    pos      -= len;
+    code_pos -= len;
+  }
+
+private:
+  /** @brief Append a byte to the output region
+   *  @param[in] value Byte to append
+   */
+  void push_back(uint8_t value)
+  {
+    if(pos >= size)
+      throw std::runtime_error("Error: Output buffer too small");
+
+    buffer[pos++] = value;
+  }
+
+  /** @brief Advance to the next flag bit */
+  void next()
+  {
+    if(shift == 0)
+    {
+      // we need to encode more data, so add a new code byte
+      shift = 8;
+      code_pos = pos;
+      push_back(0);
+    }
+
+    // advance code byte bit position
+    --shift;
+  }
+
+  uint8_t *buffer;  ///< Output region
+  size_t size;      ///< Output region size
+  size_t pos;       ///< Output position
+  LZSS_t mode;      ///< LZ mode
+  size_t code_pos;  ///< Position of current code byte
+  size_t shift;     ///< Current code byte bit position
+};
+
+/** @brief Parsed token */
+struct Token
+{
+  uint32_t len;  ///< Match length (1 for an uncompressed byte)
+  uint16_t disp; ///< Match displacement
+};
+
+/** @brief Token recorder, replayed into a token writer later */
+class TokenList
+{
+public:
+  /** @brief Record an uncompressed byte */
+  void literal(uint8_t)
+  {
+    tokens.push_back(Token{1, 0});
+  }
+
+  /** @brief Record a compressed block
+   *  @param[in] len  Match length
+   *  @param[in] disp Match displacement
+   */
+  void match(size_t len, size_t disp)
+  {
+    tokens.push_back(Token{static_cast<uint32_t>(len),
+                           static_cast<uint16_t>(disp)});
+  }
+
+  /** @brief Replay the recorded tokens
+   *  @param[in] source Source buffer
+   *  @param[in] first  Position of the first token
+   *  @param[in] writer Token writer
+   */
+  template<typename Writer>
+  void replay(const Buffer &source, size_t first, Writer &writer) const
+  {
+    for(const Token &token: tokens)
     {
-      if(*(p+i) == *(it+i))
-        ++test_len;
+      if(token.len == 1)
+        writer.literal(source[first]);
       else
-        break;
+        writer.match(token.len, token.disp);
+      first += token.len;
     }
+  }
 
-    // vram requires displacement != 1
-    if(vram && (it - p) == 1)
-      test_len = 0;
+private:
+  std::vector<Token> tokens; ///< Recorded tokens
+};
 
-    if(test_len >= best_len)
+/** @brief Read the tokens of a compressed stream
+ *  @param[in]  source Compressed buffer
+ *  @param[out] tokens Tokens (length 1 for an uncompressed byte)
+ */
+void
+read_tokens(const Buffer &source, std::vector<Token> &tokens)
+{
+  size_t size = decoded_size(source);
+  size_t out  = 0;
+  size_t pos  = 4;
+
+  const bool lz11 = source[0] == LZ11;
+
+  uint8_t flags = 0;
+  uint8_t mask  = 0;
+  while(out < size)
+  {
+    if(mask == 0)
     {
-      // this match is the best so far, so save it
-      best_start = p;
-      best_len   = test_len;
+      if(pos >= source.size())
+        throw std::runtime_error("Error: Truncated LZSS stream");
+
+      flags = source[pos++];
+      mask  = 0x80;
     }
 
-    // if we maximized the match, stop here
-    if(best_len == len)
-      break;
+    if(flags & mask) // compressed block
+    {
+      if(pos + 2 > source.size())
+        throw std::runtime_error("Error: Truncated LZSS stream");
 
-    // find next nearest matching byte and try again
-    last_p = p;
-    p = rfind(begin, last_p, *it);
+      size_t len = (source[pos] >> 4) + 3;
+      if(lz11)
+      {
+        const size_t indicator = source[pos] >> 4;
+        const size_t extra     = indicator == 0 ? 1 : indicator == 1 ? 2 : 0;
+        if(pos + 2 + extra > source.size())
+          throw std::runtime_error("Error: Truncated LZSS stream");
+
+        if(indicator == 0)
+          len = ((source[pos] << 4) | (source[pos+1] >> 4)) + 0x11;
+        else if(indicator == 1)
+          len = (((source[pos] & 0x0F) << 12) | (source[pos+1] << 4)
+              | (source[pos+2] >> 4)) + 0x111;
+        else
+          len = indicator + 1;
+        pos += extra;
+      }
+
+      const size_t disp = (((source[pos] & 0x0F) << 8) | source[pos+1]) + 1;
+      pos += 2;
+
+      if(disp > out || len > size - out)
+        throw std::runtime_error("Error: Badly encoded LZSS stream");
+
+      tokens.push_back(Token{static_cast<uint32_t>(len),
+                             static_cast<uint16_t>(disp)});
+      out += len;
+    }
+    else // uncompressed block
+    {
+      if(pos >= source.size())
+        throw std::runtime_error("Error: Truncated LZSS stream");
+
+      tokens.push_back(Token{1, 0});
+      ++pos;
+      ++out;
+    }
+
+    mask >>= 1;
   }
+}
+
+/** @brief Read a little-endian 32-bit value
+ *  @param[in] p Input
+ *  @returns Value
+ */
+inline size_t
+read32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<size_t>(p[3]) << 24);
+}
+
+/** @brief Write a little-endian 32-bit value
+ *  @param[out] p     Output
+ *  @param[in]  value Value
+ */
+inline void
+write32(uint8_t *p, size_t value)
+{
+  p[0] = value >>  0;
+  p[1] = value >>  8;
+  p[2] = value >> 16;
+  p[3] = value >> 24;
+}
+
+/** @brief Stream encoder block size */
+const size_t STREAM_BLOCK = 1 << 16;
+
+/** @brief Minimum segment size for parallel encoding */
+const size_t SEGMENT_MIN = 1 << 16;
+
+/** @brief Greedy parse with one step of lazy evaluation
+ *
+ *  In VRAM mode a run cannot be copied from one byte back, so the parse also
+ *  considers priming two bytes and copying the run from two bytes back.
+ *
+ *  @param[in] source  Source buffer
+ *  @param[in] first   First position to encode
+ *  @param[in] last    End of positions to encode
+ *  @param[in] max_len Maximum match length
+ *  @param[in] vram    VRAM-safe
+ *  @param[in] find    Match finder
+ *  @param[in] writer  Token writer
+ */
+template<typename Find, typename Writer>
+void
+lazy_parse(const Buffer &source, size_t first, size_t last, size_t max_len,
+           bool vram, Find &find, Writer &writer)
+{
+  // the lookahead searches each position ahead of time, so reuse them
+  MatchCache cache;
+  auto search = [&](Buffer::const_iterator it, size_t len, size_t &outlen)
+  {
+    Buffer::const_iterator match;
+    if(!cache.lookup(it, match, outlen))
+    {
+      match = find(it, len, outlen);
+      cache.store(it, match, outlen);
+    }
+
+    return match;
+  };
+
+  auto it = source.cbegin() + first;
+  auto end = source.cbegin() + last;
+  while(it < end)
+  {
+    const size_t len = end - it;
+    auto         tmp = source.cend();
+    size_t       tmplen = 0;
+
+    if(it == source.cbegin())
+    {
+      // beginning of stream must be primed with at least one value
+      tmplen = 1;
+    }
+    else
+    {
+      // find best match
+      tmp = search(it, std::min(len, max_len), tmplen);
+      if(tmp != source.cend())
+      {
+        assert(tmp >= source.cbegin());
+        assert(tmp < it);
+        assert(tmplen <= max_len);
+        assert(tmplen <= len);
+        assert(std::equal(it, it+tmplen, tmp));
+      }
+    }
+
+    if(tmplen > 2 && tmplen < len)
+    {
+      // this match is long enough to be compressed; let's check if it's
+      // cheaper to encode this byte as a copy and start compression at the
+      // next byte
+      size_t skip_len, next_len;
+
+      // get best match starting at the next byte
+      search(it+1, std::min(len-1, max_len), skip_len);
+
+      // check if the match is too small to compress
+      if(skip_len < 3)
+        skip_len = 1;
+
+      // get best match for data following the current compressed chunk
+      search(it+tmplen, std::min(len-tmplen, max_len), next_len);
+
+      // check if the match is too small to compress
+      if(next_len < 3)
+        next_len = 1;
+
+      // if compressing this chunk and the next chunk is less valuable than
+      // skipping this byte and starting compression at the next byte, mark
+      // this byte as being needed to copy
+      if(tmplen + next_len <= skip_len + 1)
+        tmplen = 1;
+      else if(vram && len > 2 && it[1] == it[0]
+           && it - source.cbegin() >= 2 && it[-1] != it[0])
+      {
+        // a run starts here; compare against priming two bytes and copying
+        // the rest of the run from two bytes back
+        size_t run_len;
+        auto run = search(it+2, std::min(len-2, max_len), run_len);
+        if(run_len >= 3 && it+2 - run == 2 && tmplen + next_len <= run_len + 2)
+          tmplen = 1;
+      }
+    }
+
+    if(tmplen < 3)
+    {
+      // only one byte is copied
+      writer.literal(*it);
+      tmplen = 1;
+    }
+    else
+    {
+      writer.match(tmplen, it - tmp);
+    }
+
+    // advance input buffer
+    it += tmplen;
+  }
+}
+
+/** @brief Encoded size of a token, including its flag bit
+ *  @param[in] mode LZ mode
+ *  @param[in] len  Match length (below 3 for an uncompressed byte)
+ *  @returns Size in bits
+ */
+inline size_t
+token_bits(LZSS_t mode, size_t len)
+{
+  if(len < 3)
+    return 9;
+  if(mode == LZ10 || len <= 0x10)
+    return 17;
+  if(len <= 0x110)
+    return 25;
+  return 33;
+}
+
+/** @brief Token counter
+ *
+ *  Stands in for a TokenWriter when only the compressed size is wanted.
+ */
+class TokenCounter
+{
+public:
+  /** @brief Constructor
+   *  @param[in] mode LZ mode
+   */
+  explicit TokenCounter(LZSS_t mode)
+  : mode(mode)
+  {
+  }
+
+  /** @brief Count an uncompressed byte */
+  void literal(uint8_t)
+  {
+    ++tokens;
+    ++bytes;
+  }
+
+  /** @brief Count a compressed block
+   *  @param[in] len Match length
+   */
+  void match(size_t len, size_t)
+  {
+    ++tokens;
+    bytes += token_bits(mode, len) / 8;
+  }
+
+  /** @brief Compressed size, including header and padding
+   *  @returns Output length
+   */
+  size_t finish() const
+  {
+    // header, one flag byte per eight tokens (at least one), padded to 4
+    const size_t flags = std::max<size_t>((tokens + 7) / 8, 1);
+    return (4 + flags + bytes + 3) & ~static_cast<size_t>(0x3);
+  }
+
+private:
+  LZSS_t mode;       ///< LZ mode
+  size_t tokens = 0; ///< Number of tokens
+  size_t bytes  = 0; ///< Token bytes, excluding flag bytes
+};
+
+/** @brief Cheapest suffix cost over a range of positions */
+class CostTree
+{
+public:
+  /** @brief Constructor
+   *  @param[in] n Number of positions
+   */
+  explicit CostTree(size_t n)
+  : size(1)
+  {
+    while(size < n)
+      size <<= 1;
+    cost.assign(size, UINT64_MAX);
+    best.assign(2 * size, 0);
+    for(size_t i = 0; i < size; ++i)
+      best[size + i] = i;
+  }
+
+  /** @brief Set the cost of a position
+   *  @param[in] pos   Position
+   *  @param[in] value Cost to encode from this position to the end
+   */
+  void set(size_t pos, uint64_t value)
+  {
+    cost[pos] = value;
+    for(size_t i = (pos + size) >> 1; i > 0; i >>= 1)
+      best[i] = pick(best[2*i], best[2*i+1]);
+  }
+
+  /** @brief Cheapest position within an inclusive range
+   *  @param[in] first First position
+   *  @param[in] last  Last position
+   *  @returns Cheapest position, preferring the farthest on ties
+   */
+  size_t min(size_t first, size_t last) const
+  {
+    size_t result = first;
+    for(first += size, last += size + 1; first < last;
+        first >>= 1, last >>= 1)
+    {
+      if(first & 1)
+        result = pick(result, best[first++]);
+      if(last & 1)
+        result = pick(result, best[--last]);
+    }
+    return result;
+  }
+
+  /** @brief Cost of a position
+   *  @param[in] pos Position
+   *  @returns Cost to encode from this position to the end
+   */
+  uint64_t operator[](size_t pos) const
+  {
+    return cost[pos];
+  }
+
+private:
+  /** @brief Pick the cheaper of two positions
+   *  @param[in] a First position
+   *  @param[in] b Second position
+   *  @returns Cheaper position, preferring the farthest on ties
+   */
+  size_t pick(size_t a, size_t b) const
+  {
+    if(cost[a] != cost[b])
+      return cost[a] < cost[b] ? a : b;
+    return std::max(a, b);
+  }
+
+  size_t                size; ///< Number of leaves
+  std::vector<uint64_t> cost; ///< Cost of each position
+  std::vector<size_t>   best; ///< Cheapest position in each subtree
+};
+
+/** @brief Match length classes with a constant encoding
+ *  @param[in]  mode  LZ mode
+ *  @param[out] count Number of classes
+ *  @returns First and last length of each class
+ */
+const size_t (*length_classes(LZSS_t mode, size_t &count))[2]
+{
+  static const size_t lz10_classes[][2] = { { 3, LZ10_MAX_LEN } };
+  static const size_t lz11_classes[][2] =
+  {
+    { 3, 0x10 }, { 0x11, 0x110 }, { 0x111, LZ11_MAX_LEN },
+  };
+
+  count = mode == LZ10 ? 1 : 3;
+  return mode == LZ10 ? lz10_classes : lz11_classes;
+}
+
+/** @brief Estimated BIOS LZ77UnCompVram cycles
+ *
+ *  Rough figures for the BIOS routine, which reads the source a byte at a
+ *  time and buffers output bytes into halfword stores. Only their relative
+ *  size matters to the parse.
+ */
+const uint32_t CYCLES_HEADER  = 60; ///< Call overhead and header read
+const uint32_t CYCLES_FLAG    = 14; ///< Read a flag byte
+const uint32_t CYCLES_LITERAL = 20; ///< Test the flag bit, copy a source byte
+const uint32_t CYCLES_MATCH   = 38; ///< Test the flag bit, unpack a match
+const uint32_t CYCLES_EXTEND  = 8;  ///< Read an extended LZ11 length byte
+const uint32_t CYCLES_COPY    = 18; ///< Copy one byte of a match
+const uint32_t CYCLES_WRITE   = 8;  ///< Store a halfword of output
+
+/** @brief Token cost model for the optimal parse */
+struct CostModel
+{
+  uint64_t literal;  ///< Cost of an uncompressed byte
+  uint64_t match[3]; ///< Cost of a match in each length class
+  uint64_t per_byte; ///< Additional cost per byte copied by a match
+};
+
+/** @brief Cost model for the smallest output
+ *  @param[in] mode LZ mode
+ *  @returns Token sizes in bits, including the flag bit
+ */
+CostModel
+size_model(LZSS_t mode)
+{
+  size_t count;
+  const size_t (*classes)[2] = length_classes(mode, count);
+
+  CostModel model = CostModel();
+  model.literal = token_bits(mode, 1);
+  for(size_t c = 0; c < count; ++c)
+    model.match[c] = token_bits(mode, classes[c][0]);
+
+  return model;
+}
+
+/** @brief Cost model for the fastest decode
+ *  @param[in] mode LZ mode
+ *  @returns Token decode cycles in eighths, including a share of the flag
+ *           byte
+ */
+CostModel
+cycle_model(LZSS_t mode)
+{
+  size_t count;
+  length_classes(mode, count);
+
+  CostModel model = CostModel();
+  model.literal  = 8 * CYCLES_LITERAL + 4 * CYCLES_WRITE + CYCLES_FLAG;
+  model.per_byte = 8 * CYCLES_COPY    + 4 * CYCLES_WRITE;
+  for(size_t c = 0; c < count; ++c)
+    model.match[c] = 8 * (CYCLES_MATCH + c * CYCLES_EXTEND) + CYCLES_FLAG;
+
+  return model;
+}
+
+/** @brief Cheapest path through the matches
+ *
+ *  Every prefix of the longest match at a position is also a match, and a
+ *  match's cost only depends on its length class and linearly on its length,
+ *  so the cheapest continuation for each class is a range minimum over the
+ *  suffix costs.
+ *
+ *  @param[in]  lens  Longest match at every position
+ *  @param[in]  mode  LZ mode
+ *  @param[in]  model Token cost model
+ *  @param[out] steps Token length at every position on the path
+ */
+void
+shortest_path(const std::vector<uint32_t> &lens, LZSS_t mode,
+              const CostModel &model, std::vector<uint32_t> &steps)
+{
+  const size_t size = lens.size();
+
+  size_t num_classes;
+  const size_t (*classes)[2] = length_classes(mode, num_classes);
+
+  // the tree holds each suffix cost plus the per-byte cost of reaching it,
+  // so the range minimum accounts for the match length too
+  CostTree cost(size + 1);
+  cost.set(size, model.per_byte * size);
+  steps.assign(size, 1);
+  for(size_t i = size; i-- > 0; )
+  {
+    const uint64_t base = model.per_byte * i;
+    uint64_t       best = model.literal + cost[i+1] - base - model.per_byte;
+    size_t         step = 1;
+
+    for(size_t c = 0; c < num_classes && classes[c][0] <= lens[i]; ++c)
+    {
+      size_t   last = std::min<size_t>(classes[c][1], lens[i]);
+      size_t   next = cost.min(i + classes[c][0], i + last);
+      uint64_t total = model.match[c] + cost[next] - base;
+      if(total <= best)
+      {
+        best = total;
+        step = next - i;
+      }
+    }
+
+    steps[i] = step;
+    cost.set(i, best + base);
+  }
+}
+
+/** @brief Compressed size of a path
+ *  @param[in] steps Token length at every position on the path
+ *  @param[in] mode  LZ mode
+ *  @returns Output length, including header and padding
+ */
+size_t
+path_size(const std::vector<uint32_t> &steps, LZSS_t mode)
+{
+  size_t tokens = 0, bytes = 0;
+  for(size_t i = 0; i < steps.size(); i += steps[i])
+  {
+    ++tokens;
+    bytes += token_bits(mode, steps[i]) / 8;
+  }
+
+  const size_t flags = std::max<size_t>((tokens + 7) / 8, 1);
+  return (4 + flags + bytes + 3) & ~static_cast<size_t>(0x3);
+}
+
+/** @brief Cost-optimal parse
+ *
+ *  The smallest output, or with OBJECTIVE_CYCLES the fastest to decode that
+ *  fits the size budget: size is traded for cycles with a Lagrange
+ *  multiplier, searched until the output fits. If even the smallest output
+ *  does not fit, that is used.
+ *
+ *  @param[in] source  Source buffer
+ *  @param[in] first   First position to encode
+ *  @param[in] last    End of positions to encode
+ *  @param[in] mode    LZ mode
+ *  @param[in] max_len Maximum match length
+ *  @param[in] options Encoder options
+ *  @param[in] find    Match finder
+ *  @param[in] writer  Token writer
+ */
+template<typename Find, typename Writer>
+void
+optimal_parse(const Buffer &source, size_t first, size_t last, LZSS_t mode,
+              size_t max_len, const EncodeOptions &options, Find &find,
+              Writer &writer)
+{
+  const size_t size = last - first;
+
+  // find the longest match at every position; the stream must be primed
+  // with at least one value
+  std::vector<uint32_t> lens(size);
+  std::vector<uint16_t> disps(size);
+  for(size_t i = first == 0 ? 1 : 0; i < size; ++i)
+  {
+    auto   it = source.cbegin() + first + i;
+    size_t len;
+    auto   match = find(it, std::min(size - i, max_len), len);
+    if(len >= 3)
+    {
+      lens[i]  = len;
+      disps[i] = it - match;
+    }
+  }
+
+  // compute the cheapest encoding of every suffix, back to front
+  std::vector<uint32_t> steps;
+  if(options.objective == OBJECTIVE_SIZE)
+    shortest_path(lens, mode, size_model(mode), steps);
+  else
+  {
+    const CostModel cycles = cycle_model(mode);
+    shortest_path(lens, mode, cycles, steps);
+
+    const size_t budget = options.size_budget;
+    if(budget && path_size(steps, mode) > budget)
+    {
+      const CostModel bits = size_model(mode);
+      shortest_path(lens, mode, bits, steps);
+
+      // find the smallest weight on size that fits the budget; cycles are
+      // scaled up so the weight can be fractional
+      std::vector<uint32_t> trial;
+      uint64_t lo = 0, hi = UINT64_C(1) << 32;
+      while(path_size(steps, mode) <= budget && hi - lo > 1)
+      {
+        const uint64_t mid = lo + (hi - lo) / 2;
+
+        CostModel model;
+        model.literal  = 256 * cycles.literal + mid * bits.literal;
+        model.per_byte = 256 * cycles.per_byte;
+        for(size_t c = 0; c < 3; ++c)
+          model.match[c] = 256 * cycles.match[c] + mid * bits.match[c];
+
+        shortest_path(lens, mode, model, trial);
+        if(path_size(trial, mode) <= budget)
+        {
+          hi = mid;
+          steps.swap(trial);
+        }
+        else
+          lo = mid;
+      }
+    }
+  }
+
+  // emit the cheapest path
+  for(size_t i = 0; i < size; i += steps[i])
+  {
+    if(steps[i] == 1)
+      writer.literal(source[first + i]);
+    else
+      writer.match(steps[i], disps[i]);
+  }
+}
+
+/** @brief Parse a range of the source
+ *  @param[in] source   Source buffer
+ *  @param[in] first    First position to encode
+ *  @param[in] last     End of positions to encode
+ *  @param[in] mode     LZ mode
+ *  @param[in] max_len  Maximum match length
+ *  @param[in] vram     VRAM-safe
+ *  @param[in] options  Encoder options
+ *  @param[in] find     Match finder
+ *  @param[in] writer   Token writer
+ */
+template<typename Find, typename Writer>
+void
+parse(const Buffer &source, size_t first, size_t last, LZSS_t mode,
+      size_t max_len, bool vram, const EncodeOptions &options, Find &find,
+      Writer &writer)
+{
+  // the decode cost objective needs the whole path
+  if(options.parse == PARSE_OPTIMAL || options.objective == OBJECTIVE_CYCLES)
+    optimal_parse(source, first, last, mode, max_len, options, find, writer);
+  else
+    lazy_parse(source, first, last, max_len, vram, find, writer);
+}
+
+/** @brief Run a task for every index on a pool of threads
+ *
+ *  Indices are handed out one at a time, so uneven tasks still balance.
+ *
+ *  @param[in] count   Number of indices
+ *  @param[in] threads Number of threads
+ *  @param[in] task    Task to run for each index
+ */
+template<typename Task>
+void
+parallel_for(size_t count, size_t threads, Task task)
+{
+  std::atomic<size_t> next(0);
+  auto worker = [&]
+  {
+    for(size_t i = next++; i < count; i = next++)
+      task(i);
+  };
+
+  threads = std::min(std::max<size_t>(threads, 1), count);
+  if(threads <= 1)
+  {
+    worker();
+    return;
+  }
+
+  std::vector<std::thread> workers;
+  for(size_t i = 0; i < threads; ++i)
+    workers.emplace_back(worker);
+  for(std::thread &thread: workers)
+    thread.join();
+}
+
+/** @brief Run length from which EncodeOptions::fast_runs takes a run without
+ *  a window search
+ */
+const size_t RUN_MIN = 0x111;
+
+/** @brief Length of the repeat at a fixed displacement from every position
+ *  @param[in] source Source buffer
+ *  @param[in] disp   Displacement
+ *  @returns Number of bytes equal to the byte disp earlier, at each position
+ */
+std::vector<uint32_t>
+run_lengths(const Buffer &source, size_t disp)
+{
+  std::vector<uint32_t> runs(source.size() + 1);
+  for(size_t i = source.size(); i-- > disp; )
+  {
+    if(source[i] == source[i - disp])
+      runs[i] = runs[i+1] + 1;
+  }
+
+  return runs;
+}
+
+/** @brief Match table chunk size */
+const size_t MATCH_CHUNK = 1 << 14;
+
+/** @brief Table entry not searched yet */
+const uint32_t MATCH_UNKNOWN = UINT32_MAX;
+
+/** @brief Longest match at every position
+ *
+ *  Matches do not depend on how the source is parsed, so they are found up
+ *  front on several threads; the parse then only looks them up and chooses
+ *  exactly the same tokens as a serial search. Only worthwhile for a parse
+ *  that looks at every position.
+ */
+template<typename Find>
+class MatchTable
+{
+public:
+  /** @brief Constructor
+   *  @param[in] source  Source buffer
+   *  @param[in] max_len Maximum match length
+   *  @param[in] threads Number of threads
+   *  @param[in] find    Match finder
+   */
+  MatchTable(const Buffer &source, size_t max_len, size_t threads, Find &find)
+  : source(source),
+    find(find),
+    lens(source.size(), MATCH_UNKNOWN),
+    disps(source.size())
+  {
+    const size_t size = source.size();
+    parallel_for((size + MATCH_CHUNK - 1) / MATCH_CHUNK, threads,
+                 [&](size_t chunk)
+    {
+      const size_t end = std::min(size, (chunk + 1) * MATCH_CHUNK);
+      for(size_t i = std::max<size_t>(chunk * MATCH_CHUNK, 1); i < end; ++i)
+        search(i, std::min(size - i, max_len));
+    });
+  }
+
+  /** @brief Find best buffer match
+   *  @param[in]  it     Position in source buffer
+   *  @param[in]  len    Maximum length to match
+   *  @param[out] outlen Length of match
+   *  @returns Iterator to best match
+   *  @retval source.cend() for no match
+   */
+  Buffer::const_iterator
+  find_best_match(Buffer::const_iterator it, size_t len, size_t &outlen)
+  {
+    const size_t pos = it - source.cbegin();
+    if(lens[pos] == MATCH_UNKNOWN)
+      search(pos, len);
+
+    outlen = std::min<size_t>(lens[pos], len);
+    if(outlen == 0)
+      return source.cend();
+
+    return it - disps[pos];
+  }
+
+private:
+  /** @brief Search a position and record its match
+   *  @param[in] pos Position in source buffer
+   *  @param[in] len Maximum length to match
+   */
+  void search(size_t pos, size_t len)
+  {
+    auto   it = source.cbegin() + pos;
+    size_t outlen;
+    auto   match = find(it, len, outlen);
+
+    lens[pos]  = match != source.cend() ? outlen : 0;
+    disps[pos] = match != source.cend() ? it - match : 0;
+  }
+
+  const Buffer          &source; ///< Source buffer
+  Find                  &find;   ///< Match finder
+  std::vector<uint32_t> lens;    ///< Best match length at each position
+  std::vector<uint16_t> disps;   ///< Best match displacement at each position
+};
+
+/** @brief Suffix array block size */
+const size_t SUFFIX_BLOCK = 1 << 17;
+
+/** @brief Suffix prefix sorted unless every match is wanted up front
+ *
+ *  A longer match is searched on demand instead; there are few of them, and
+ *  the lazy parse skips their interiors.
+ */
+const size_t SUFFIX_PREFIX = 1 << 6;
+
+/** @brief Build a suffix array by prefix doubling
+ *
+ *  Suffixes are ordered by their first prefix bytes only, and by position
+ *  where those are equal.
+ *
+ *  @param[in]  text   Text to sort
+ *  @param[in]  n      Text length
+ *  @param[in]  prefix Sorted prefix length
+ *  @param[out] sa     Suffix array
+ *  @param[out] rank   Inverse suffix array
+ */
+void
+suffix_sort(const uint8_t *text, size_t n, size_t prefix,
+            std::vector<uint32_t> &sa, std::vector<uint32_t> &rank)
+{
+  std::vector<uint32_t> tmp(n), cnt(std::max<size_t>(n, 256) + 1);
+
+  sa.resize(n);
+  rank.resize(n);
+
+  // initial order by first byte
+  for(size_t i = 0; i < n; ++i)
+    ++cnt[text[i] + 1];
+  for(size_t i = 1; i < cnt.size(); ++i)
+    cnt[i] += cnt[i-1];
+  for(size_t i = 0; i < n; ++i)
+    sa[cnt[text[i]]++] = i;
+
+  rank[sa[0]] = 0;
+  for(size_t i = 1; i < n; ++i)
+    rank[sa[i]] = rank[sa[i-1]] + (text[sa[i-1]] != text[sa[i]]);
+
+  // double the sorted prefix, up to the length wanted, until every suffix
+  // has a distinct rank
+  for(size_t k = 1, step; k < prefix && rank[sa[n-1]] != n - 1; k += step)
+  {
+    // extend by at most the length already sorted
+    step = std::min(k, prefix - k);
+
+    // order by second key; suffixes shorter than step sort first
+    size_t p = 0;
+    for(size_t i = n - step; i < n; ++i)
+      tmp[p++] = i;
+    for(size_t i = 0; i < n; ++i)
+    {
+      if(sa[i] >= step)
+        tmp[p++] = sa[i] - step;
+    }
+
+    // stable counting sort by first key
+    std::fill(cnt.begin(), cnt.end(), 0);
+    for(size_t i = 0; i < n; ++i)
+      ++cnt[rank[i] + 1];
+    for(size_t i = 1; i < cnt.size(); ++i)
+      cnt[i] += cnt[i-1];
+    for(size_t i = 0; i < n; ++i)
+      sa[cnt[rank[tmp[i]]]++] = tmp[i];
+
+    // assign new ranks
+    auto key = [&](uint32_t i)
+    {
+      return std::make_pair(rank[i], i + step < n ? rank[i+step] + 1 : 0);
+    };
+
+    tmp[sa[0]] = 0;
+    for(size_t i = 1; i < n; ++i)
+      tmp[sa[i]] = tmp[sa[i-1]] + (key(sa[i-1]) != key(sa[i]));
+    rank.swap(tmp);
+  }
+
+  // order equal prefixes by position
+  if(rank[sa[n-1]] != n - 1)
+  {
+    std::fill(cnt.begin(), cnt.end(), 0);
+    for(size_t i = 0; i < n; ++i)
+      ++cnt[rank[i] + 1];
+    for(size_t i = 1; i < cnt.size(); ++i)
+      cnt[i] += cnt[i-1];
+    for(size_t i = 0; i < n; ++i)
+      sa[cnt[rank[i]]++] = i;
+    for(size_t i = 0; i < n; ++i)
+      rank[sa[i]] = i;
+  }
+}
+
+/** @brief Range minimum table block size */
+const size_t SPARSE_BLOCK = 16;
+
+/** @brief Range minimum table over an LCP array
+ *
+ *  Values are grouped in blocks of SPARSE_BLOCK; a range is scanned directly
+ *  at its ends and the whole blocks in between come from a sparse table of
+ *  block minima, whose levels share one allocation.
+ */
+class SparseTable
+{
+public:
+  /** @brief Constructor
+   *  @param[in] lcp LCP array
+   */
+  explicit SparseTable(const std::vector<uint32_t> &lcp)
+  : values(lcp),
+    blocks((lcp.size() + SPARSE_BLOCK - 1) / SPARSE_BLOCK),
+    levels(1),
+    log(blocks + 1)
+  {
+    while((size_t(2) << (levels - 1)) <= blocks)
+      ++levels;
+    for(size_t i = 2; i <= blocks; ++i)
+      log[i] = log[i / 2] + 1;
+
+    table.assign(levels * blocks, UINT32_MAX);
+    for(size_t i = 0; i < values.size(); ++i)
+      table[i / SPARSE_BLOCK] = std::min(table[i / SPARSE_BLOCK], values[i]);
+    for(size_t k = 1; k < levels; ++k)
+    {
+      const uint32_t *prev = &table[(k-1) * blocks];
+      uint32_t       *next = &table[k * blocks];
+      const size_t    half = size_t(1) << (k-1);
+      for(size_t i = 0; i + 2 * half <= blocks; ++i)
+        next[i] = std::min(prev[i], prev[i + half]);
+    }
+  }
+
+  /** @brief Minimum over an inclusive range
+   *  @param[in] first First index
+   *  @param[in] last  Last index
+   *  @returns Minimum value
+   */
+  uint32_t min(size_t first, size_t last) const
+  {
+    assert(first <= last);
+    const size_t lo = (first + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+    const size_t hi = (last + 1) / SPARSE_BLOCK;
+    if(lo >= hi)
+      return scan(first, last + 1);
+
+    // partial blocks at either end, whole blocks in between
+    uint32_t result = std::min(scan(first, lo * SPARSE_BLOCK),
+                               scan(hi * SPARSE_BLOCK, last + 1));
+    const size_t k = log[hi - lo];
+    result = std::min(result, table[k * blocks + lo]);
+    return std::min(result, table[k * blocks + hi - (size_t(1) << k)]);
+  }
+
+  /** @brief Extend a range downwards while its minimum stays large enough
+   *  @param[in] last  Last index
+   *  @param[in] bound Smallest value allowed in the range
+   *  @returns Lowest first index with min(first, last) >= bound, or last + 1
+   */
+  size_t lower(size_t last, uint32_t bound) const
+  {
+    // to the start of this block, then by whole blocks, then into the block
+    // holding a smaller value
+    size_t first = last + 1;
+    while(first > 0 && values[first - 1] >= bound)
+    {
+      if(--first % SPARSE_BLOCK != 0)
+        continue;
+
+      size_t block = first / SPARSE_BLOCK;
+      for(size_t k = levels; k-- > 0; )
+      {
+        if(block >= (size_t(1) << k)
+        && table[k * blocks + block - (size_t(1) << k)] >= bound)
+          block -= size_t(1) << k;
+      }
+      for(first = block * SPARSE_BLOCK;
+          first > 0 && values[first - 1] >= bound; --first)
+        ;
+      break;
+    }
+    return first;
+  }
+
+  /** @brief Extend a range upwards while its minimum stays large enough
+   *  @param[in] first First index
+   *  @param[in] bound Smallest value allowed in the range
+   *  @returns Highest last index with min(first, last) >= bound, or first - 1
+   */
+  size_t upper(size_t first, uint32_t bound) const
+  {
+    // to the end of this block, then by whole blocks, then into the block
+    // holding a smaller value
+    size_t last = first;
+    while(last < values.size() && values[last] >= bound)
+    {
+      if(++last % SPARSE_BLOCK != 0)
+        continue;
+
+      size_t block = last / SPARSE_BLOCK;
+      for(size_t k = levels; k-- > 0; )
+      {
+        if(block + (size_t(1) << k) <= blocks
+        && table[k * blocks + block] >= bound)
+          block += size_t(1) << k;
+      }
+      for(last = std::min(block * SPARSE_BLOCK, values.size());
+          last < values.size() && values[last] >= bound; ++last)
+        ;
+      break;
+    }
+    return last - 1;
+  }
+
+private:
+  /** @brief Minimum over a half-open range
+   *  @param[in] first First index
+   *  @param[in] last  End index
+   *  @returns Minimum value
+   */
+  uint32_t scan(size_t first, size_t last) const
+  {
+    uint32_t result = UINT32_MAX;
+    for(size_t i = first; i < last; ++i)
+      result = std::min(result, values[i]);
+    return result;
+  }
+
+  const std::vector<uint32_t> &values; ///< LCP array
+  size_t                blocks;        ///< Number of blocks
+  size_t                levels;        ///< Number of levels
+  std::vector<uint8_t>  log;           ///< Floor of log2 of each block count
+  std::vector<uint32_t> table;         ///< Minimum of each 2^k blocks, by
+                                       ///< level
+};
+
+/** @brief Window positions indexed by suffix rank */
+class RankTree
+{
+public:
+  /** @brief Constructor
+   *  @param[in] n Number of ranks
+   */
+  explicit RankTree(size_t n)
+  : size(1)
+  {
+    while(size < n)
+      size <<= 1;
+    nodes.assign(2 * size, Node{-1, INT32_MAX});
+  }
+
+  /** @brief Add or remove a position
+   *  @param[in] rank Suffix rank
+   *  @param[in] pos  Source position, or -1 to remove
+   */
+  void set(size_t rank, int32_t pos)
+  {
+    size_t i = rank + size;
+    nodes[i].hi = pos;
+    nodes[i].lo = pos < 0 ? INT32_MAX : pos;
+    for(i >>= 1; i > 0; i >>= 1)
+    {
+      nodes[i].hi = std::max(nodes[2*i].hi, nodes[2*i+1].hi);
+      nodes[i].lo = std::min(nodes[2*i].lo, nodes[2*i+1].lo);
+    }
+  }
+
+  /** @brief Nearest present rank below a rank
+   *  @param[in] rank Suffix rank
+   *  @returns Present rank
+   *  @retval -1 if none
+   */
+  ptrdiff_t below(size_t rank) const
+  {
+    // climb until a left sibling holds a position
+    size_t i = rank + size;
+    while(i > 1 && ((i & 1) == 0 || nodes[i-1].hi < 0))
+      i >>= 1;
+    if(i <= 1)
+      return -1;
+
+    // descend to its rightmost position
+    for(--i; i < size; )
+      i = nodes[2*i+1].hi >= 0 ? 2*i+1 : 2*i;
+    return i - size;
+  }
+
+  /** @brief Nearest present rank above a rank
+   *  @param[in] rank Suffix rank
+   *  @returns Present rank
+   *  @retval -1 if none
+   */
+  ptrdiff_t above(size_t rank) const
+  {
+    // climb until a right sibling holds a position
+    size_t i = rank + size;
+    while(i > 1 && ((i & 1) == 1 || nodes[i+1].hi < 0))
+      i >>= 1;
+    if(i <= 1)
+      return -1;
+
+    // descend to its leftmost position
+    for(++i; i < size; )
+      i = nodes[2*i].hi >= 0 ? 2*i : 2*i+1;
+    return i - size;
+  }
+
+  /** @brief Nearest and farthest position within an inclusive rank range
+   *  @param[in]  first    First rank
+   *  @param[in]  last     Last rank
+   *  @param[out] nearest  Highest position
+   *  @param[out] farthest Lowest position
+   */
+  void range(size_t first, size_t last, int32_t &nearest,
+             int32_t &farthest) const
+  {
+    nearest  = -1;
+    farthest = INT32_MAX;
+    for(first += size, last += size + 1; first < last;
+        first >>= 1, last >>= 1)
+    {
+      if(first & 1)
+      {
+        nearest  = std::max(nearest, nodes[first].hi);
+        farthest = std::min(farthest, nodes[first++].lo);
+      }
+      if(last & 1)
+      {
+        nearest  = std::max(nearest, nodes[--last].hi);
+        farthest = std::min(farthest, nodes[last].lo);
+      }
+    }
+  }
+
+private:
+  /** @brief Subtree summary */
+  struct Node
+  {
+    int32_t hi; ///< Highest position in the subtree
+    int32_t lo; ///< Lowest position in the subtree
+  };
+
+  size_t            size;  ///< Number of leaves
+  std::vector<Node> nodes; ///< Subtree summaries, root first
+};
+
+
+/** @brief Encode the tail of a buffer
+ *
+ *  Every byte from first onwards is encoded; the bytes before it are only
+ *  matched against.
+ *
+ *  @param[in] source  Source buffer
+ *  @param[in] first   First position to encode
+ *  @param[in] mode    LZ mode
+ *  @param[in] vram    VRAM-safe
+ *  @param[in] options Encoder options
+ *  @param[in] writer  Token writer
+ */
+template<typename Writer>
+void
+encode(const Buffer &source, size_t first, LZSS_t mode, bool vram,
+       const EncodeOptions &options, Writer &writer)
+{
+  // get maximum match length
+  const size_t max_len  = mode == LZ10 ? LZ10_MAX_LEN  : LZ11_MAX_LEN;
+
+  // get maximum displacement
+  const size_t max_disp = mode == LZ10 ? LZ10_MAX_DISP : LZ11_MAX_DISP;
+
+  assert(mode == LZ10 || mode == LZ11);
+
+  // build the hash chains up front if requested
+  std::unique_ptr<HashChain> chain;
+  if(options.match == MATCH_HASH_CHAIN)
+    chain.reset(new HashChain(source, options.max_chain));
+
+  // or precompute the matches with the suffix array; the optimal parse
+  // looks at every position, the lazy parse rarely inside a long match
+  const size_t threads  = std::max<size_t>(options.threads, 1);
+  const bool   complete = options.parse == PARSE_OPTIMAL
+                       || options.objective == OBJECTIVE_CYCLES;
+  std::unique_ptr<SuffixArray> suffix;
+  if(options.match == MATCH_SUFFIX)
+    suffix.reset(new SuffixArray(source, max_len, max_disp, vram, threads,
+                                 complete));
+
+  // find runs and short periodic repeats in one pass each, nearest first;
+  // vram requires displacement != 1
+  const std::vector<size_t> periods = vram ? std::vector<size_t>{2, 4}
+                                           : std::vector<size_t>{1, 2, 4};
+  std::vector<std::vector<uint32_t>> runs;
+  if(options.runs || options.fast_runs)
+  {
+    for(size_t period: periods)
+      runs.push_back(run_lengths(source, period));
+  }
+
+  // search with the selected match finder
+  auto window = [&](Buffer::const_iterator it, size_t len, size_t &outlen)
+  {
+    if(chain)
+      return chain->find_best_match(it, len, max_disp, vram, outlen);
+
+    if(suffix)
+      return suffix->find_best_match(it, len, outlen);
+
+    return find_best_match(source, it, len, max_disp, vram, outlen);
+  };
+
+  auto scan = [&](Buffer::const_iterator it, size_t len, size_t &outlen)
+  {
+    if(runs.empty())
+      return window(it, len, outlen);
+
+    // a repeat that reaches the length limit is exactly what a window search
+    // would find; with fast_runs a long one is taken as is, even if a longer
+    // match lies further back in the window
+    const size_t pos = it - source.cbegin();
+    for(size_t i = 0; i < periods.size(); ++i)
+    {
+      const size_t run = runs[i][pos];
+      if(run >= 3 && (run >= len || (options.fast_runs && run >= RUN_MIN)))
+      {
+        outlen = std::min(run, len);
+        return it - periods[i];
+      }
+    }
+
+    // otherwise the repeats are candidates next to the window search, so a
+    // depth-limited search still finds them
+    auto match = window(it, len, outlen);
+    for(size_t i = 0; i < periods.size(); ++i)
+    {
+      const size_t run = runs[i][pos];
+      if(run >= 3 && run > outlen)
+      {
+        outlen = run;
+        match  = it - periods[i];
+      }
+    }
+
+    return match;
+  };
+
+  // the optimal parse looks at every position, so unless segmenting, search
+  // them all in parallel first and parse from the table; the lazy parse
+  // looks at only a few positions per token and is segmented instead
+  typedef MatchTable<decltype(scan)> Table;
+  std::unique_ptr<Table> table;
+  const bool segmented = options.segmented || !complete;
+  if(threads > 1 && !segmented && !suffix)
+    table.reset(new Table(source, max_len, threads, scan));
+
+  auto find = [&](Buffer::const_iterator it, size_t len, size_t &outlen)
+  {
+    if(table)
+      return table->find_best_match(it, len, outlen);
+
+    return scan(it, len, outlen);
+  };
+
+  // split the source into one segment per thread, each at least SEGMENT_MIN
+  // long; a size budget covers the whole stream
+  const size_t size = source.size() - first;
+  size_t segments = segmented && !options.size_budget ? threads : 1;
+  segments = std::min(segments, std::max<size_t>(size / SEGMENT_MIN, 1));
+
+  if(segments == 1)
+    parse(source, first, first + size, mode, max_len, vram, options, find,
+          writer);
+  else
+  {
+    // segments still match against the window preceding them, so only the
+    // tokens at each seam differ from a serial encode
+    std::vector<TokenList>   lists(segments);
+    std::vector<std::thread> workers;
+    for(size_t i = 0; i < segments; ++i)
+    {
+      workers.emplace_back([&, i]
+      {
+        parse(source, first + size * i / segments,
+              first + size * (i+1) / segments, mode, max_len, vram, options,
+              find, lists[i]);
+      });
+    }
+
+    // stitch the segments together, regrouping the flag bytes
+    for(size_t i = 0; i < segments; ++i)
+    {
+      workers[i].join();
+      lists[i].replay(source, first + size * i / segments, writer);
+    }
+  }
+}
+
+/** @brief Output slack needed past a match for the wide copy paths */
+const size_t COPY_SLACK = 32;
+
+/** @brief Copy a back-reference
+ *  @param[in] out  Current output position
+ *  @param[in] disp Displacement
+ *  @param[in] len  Length
+ *  @param[in] end  End of output region
+ *  @returns Output position after the copy
+ *
+ *  Whole 16- or 32-byte blocks are written when there is room for them, so
+ *  up to COPY_SLACK bytes past the match may be clobbered; later tokens
+ *  overwrite them.  Near the end of the region this falls back to an exact
+ *  copy.
+ */
+inline uint8_t*
+copy_match(uint8_t *out, size_t disp, size_t len, const uint8_t *end)
+{
+  const uint8_t *from = out - disp;
+  uint8_t *const stop = out + len;
+
+  if(static_cast<size_t>(end - stop) < COPY_SLACK)
+  {
+    if(disp >= len)
+      std::memcpy(out, from, len);
+    else
+    {
+      while(out != stop)
+        *out++ = *from++;
+    }
+
+    return stop;
+  }
+
+  if(disp < 16)
+  {
+    // replicate the period into a block, then store the block at a stride
+    // that is a multiple of the period
+    uint8_t  pattern[16];
+    size_t   stride = sizeof(pattern);
+    uint64_t word = 0;
+    uint32_t full;
+    uint16_t half;
+
+    switch(disp)
+    {
+      case 1: // broadcast a byte
+        word = from[0] * UINT64_C(0x0101010101010101);
+        break;
+
+      case 2: // broadcast a halfword
+        std::memcpy(&half, from, 2);
+        word = half * UINT64_C(0x0001000100010001);
+        break;
+
+      case 4: // broadcast a word
+        std::memcpy(&full, from, 4);
+        word = full * UINT64_C(0x0000000100000001);
+        break;
+
+      case 8:
+        std::memcpy(&word, from, 8);
+        break;
+
+      default:
+        for(size_t i = 0; i < sizeof(pattern); ++i)
+          pattern[i] = i < disp ? from[i] : pattern[i - disp];
+
+        stride -= sizeof(pattern) % disp;
+        break;
+    }
+
+    if(stride == sizeof(pattern))
+    {
+      std::memcpy(pattern, &word, 8);
+      std::memcpy(pattern + 8, &word, 8);
+    }
+
+    for(; out < stop; out += stride)
+      std::memcpy(out, pattern, sizeof(pattern));
+  }
+  else if(disp < 32)
+  {
+    // each block reads only bytes already written
+    for(; out < stop; out += 16, from += 16)
+      std::memcpy(out, from, 16);
+  }
+  else
+  {
+    for(; out < stop; out += 32, from += 32)
+      std::memcpy(out, from, 32);
+  }
+
+  return stop;
+}
+
+/** @brief Encoded size of a back-reference
+ *  @tparam    Mode  LZ mode
+ *  @param[in] first First byte of the back-reference
+ *  @returns Encoded size
+ */
+template<LZSS_t Mode>
+inline size_t
+match_size(uint8_t first)
+{
+  if(Mode == LZ10)
+    return 2;
+
+  switch(first >> 4)
+  {
+    case 0:  return 3; // extended block
+    case 1:  return 4; // extra extended block
+    default: return 2; // normal block
+  }
+}
+
+/** @brief Read a back-reference
+ *  @tparam       Mode LZ mode
+ *  @param[inout] src  Compressed data
+ *  @param[out]   len  Length
+ *  @returns Displacement
+ */
+template<LZSS_t Mode>
+inline size_t
+read_match(const uint8_t *&src, size_t &len)
+{
+  if(Mode == LZ10)
+    len = ((*src) >> 4) + 3;
+  else
+  {
+    switch((*src) >> 4)
+    {
+      case 0: // extended block
+        len   = (*src++) << 4;
+        len  |= ((*src) >> 4);
+        len  += 0x11;
+        break;
+
+      case 1: // extra extended block
+        len   = ((*src++) & 0x0F) << 12;
+        len  |= (*src++) << 4;
+        len  |= ((*src) >> 4);
+        len  += 0x111;
+        break;
+
+      default: // normal block
+        len   = ((*src) >> 4) + 1;
+        break;
+    }
+  }
+
+  size_t disp = ((*src++) & 0x0F) << 8;
+  disp |= *src++;
+  return disp + 1;
+}
+
+/** @brief LZ10/LZ11 Decompression into an output region
+ *  @tparam     Mode       LZ mode
+ *  @tparam     Vram       Check whether the stream is VRAM-safe
+ *  @param[in]  stream     Compressed data, starting with the header
+ *  @param[in]  stream_end End of compressed data
+ *  @param[out] dest       Output region
+ *  @param[in]  size       Uncompressed data size
+ *  @param[out] result     Outcome
+ *
+ *  Whole flag groups are decoded without input checks while a worst-case
+ *  group of input remains; the rest of the stream checks every read, so
+ *  truncated or garbage input never reads past stream_end.
+ */
+template<LZSS_t Mode, bool Vram>
+void
+decode(const uint8_t *stream, const uint8_t *stream_end, uint8_t *dest,
+       size_t size, DecodeResult &result)
+{
+  // flag byte followed by eight of the longest back-references
+  const size_t group_max = 1 + 8 * (Mode == LZ10 ? 2 : 4);
+
+  auto    src   = stream + 4;
+  uint8_t flags = 0;
+  uint8_t mask  = 0;
+
+  uint8_t       *out = dest;
+  uint8_t *const end = dest + size;
+
+  auto fail = [&](LZSS_status_t status, const uint8_t *at)
+  {
+    result.status   = status;
+    result.position = at - stream;
+    result.size     = out - dest;
+  };
+
+  auto copy = [&](size_t len, size_t disp)
+  {
+    if(len > static_cast<size_t>(end - out))
+    {
+      // truncate output
+      result.overrun = true;
+      len = end - out;
+    }
+
+    if(disp > static_cast<size_t>(out - dest))
+      return false;
+
+    if(Vram && disp == 1)
+      result.vram_unsafe = true;
+
+    // for len, copy data from the displacement
+    // to the current buffer position; the output was sized from the
+    // header and len was clamped above, so no capacity checks are needed
+    out = copy_match(out, disp, len, end);
+    return true;
+  };
+
+  while(out < end && static_cast<size_t>(stream_end - src) >= group_max)
+  {
+    // read in the flags data
+    // from bit 7 to bit 0:
+    //     0: raw byte
+    //     1: compressed block
+    flags = *src++;
+
+    if(flags == 0 && end - out >= 8)
+    {
+      // eight raw bytes in a row
+      std::memcpy(out, src, 8);
+      out += 8;
+      src += 8;
+      continue;
+    }
+
+    for(mask = 0x80; mask != 0 && out < end; mask >>= 1)
+    {
+      if(flags & mask) // compressed block
+      {
+        const uint8_t *token = src;
+
+        size_t len;
+        size_t disp = read_match<Mode>(src, len);
+        if(!copy(len, disp))
+        {
+          fail(STATUS_BAD_DISPLACEMENT, token);
+          return;
+        }
+      }
+      else // uncompressed block
+      {
+        // copy a raw byte from the input to the output
+        *out++ = *src++;
+      }
+    }
+  }
+
+  // finish the stream one checked token at a time
+  mask = 0;
+  while(out < end)
+  {
+    if(mask == 0)
+    {
+      if(src == stream_end)
+      {
+        fail(STATUS_TRUNCATED, src);
+        return;
+      }
+
+      flags = *src++;
+      mask  = 0x80;
+    }
+
+    if(flags & mask) // compressed block
+    {
+      if(src == stream_end
+      || static_cast<size_t>(stream_end - src) < match_size<Mode>(*src))
+      {
+        fail(STATUS_TRUNCATED, src);
+        return;
+      }
+
+      const uint8_t *token = src;
+
+      size_t len;
+      size_t disp = read_match<Mode>(src, len);
+      if(!copy(len, disp))
+      {
+        fail(STATUS_BAD_DISPLACEMENT, token);
+        return;
+      }
+    }
+    else // uncompressed block
+    {
+      if(src == stream_end)
+      {
+        fail(STATUS_TRUNCATED, src);
+        return;
+      }
+
+      *out++ = *src++;
+    }
+
+    mask >>= 1;
+  }
+
+  result.status   = STATUS_OK;
+  result.position = src - stream;
+  result.size     = size;
+}
+
+/** @brief Walk an LZ10/LZ11 stream without writing any output
+ *  @tparam     Mode       LZ mode
+ *  @param[in]  stream     Compressed data, starting with the header
+ *  @param[in]  stream_end End of compressed data
+ *  @param[in]  size       Uncompressed data size
+ *  @param[out] result     Outcome
+ */
+template<LZSS_t Mode>
+void
+validate(const uint8_t *stream, const uint8_t *stream_end, size_t size,
+         DecodeResult &result)
+{
+  auto    src   = stream + 4;
+  uint8_t flags = 0;
+  uint8_t mask  = 0;
+  size_t  pos   = 0;
+
+  auto fail = [&](LZSS_status_t status, const uint8_t *at)
+  {
+    result.status   = status;
+    result.position = at - stream;
+    result.size     = pos;
+  };
+
+  while(pos < size)
+  {
+    if(mask == 0)
+    {
+      if(src == stream_end)
+      {
+        fail(STATUS_TRUNCATED, src);
+        return;
+      }
+
+      flags = *src++;
+      mask  = 0x80;
+
+      if(flags == 0 && size - pos >= 8 && stream_end - src >= 8)
+      {
+        // eight raw bytes in a row
+        src  += 8;
+        pos  += 8;
+        mask  = 0;
+        continue;
+      }
+    }
+
+    if(flags & mask) // compressed block
+    {
+      if(src == stream_end
+      || static_cast<size_t>(stream_end - src) < match_size<Mode>(*src))
+      {
+        fail(STATUS_TRUNCATED, src);
+        return;
+      }
+
+      const uint8_t *token = src;
+
+      size_t len;
+      size_t disp = read_match<Mode>(src, len);
+
+      if(disp > pos)
+      {
+        fail(STATUS_BAD_DISPLACEMENT, token);
+        return;
+      }
+
+      if(len > size - pos)
+      {
+        fail(STATUS_OVERRUN, token);
+        return;
+      }
+
+      pos += len;
+    }
+    else // uncompressed block
+    {
+      if(src == stream_end)
+      {
+        fail(STATUS_TRUNCATED, src);
+        return;
+      }
+
+      ++src;
+      ++pos;
+    }
+
+    mask >>= 1;
+  }
+
+  result.status   = STATUS_OK;
+  result.position = src - stream;
+  result.size     = size;
+}
+
+/** @brief Throw the error for a failed decode
+ *  @param[in] source Compressed data
+ *  @param[in] result Outcome
+ */
+void
+throw_status(const uint8_t *source, const DecodeResult &result)
+{
+  if(result.status == STATUS_OK)
+    return;
+
+  if(result.status == STATUS_BAD_HEADER)
+    throw std::runtime_error("Error: Invalid LZSS header");
+
+  if(result.status == STATUS_OUTPUT_TOO_SMALL)
+    throw std::runtime_error("Error: Output buffer too small");
+
+  // the header is valid past this point
+  const std::string name = source[0] == LZ10 ? "LZ10" : "LZ11";
+
+  switch(result.status)
+  {
+    case STATUS_TRUNCATED:
+      throw std::runtime_error("Error: Truncated " + name + " stream; "
+                               "compressed data ends before the output "
+                               "length specified by header.");
+
+    case STATUS_BAD_DISPLACEMENT:
+      throw std::runtime_error("Error: Badly encoded " + name + " stream; "
+                               "encoded displacement causes read prior to "
+                               "start of output buffer.");
+
+    default:
+      throw std::runtime_error("Error: Badly encoded " + name + " stream; "
+                               "compressed block exceeds output length "
+                               "specified by header.");
+  }
+}
+
+/** @brief Resumable decoder state
+ *
+ *  Everything needed to continue decoding a stream: the history ring, the
+ *  flag byte and mask and a partially copied match.
+ */
+struct DecodeState
+{
+  /** @brief Decompress from a compressed region
+   *  @param[inout] src     Compressed data; advanced past consumed tokens
+   *  @param[in]    src_end End of compressed data
+   *  @param[out]   dest    Output region, or nullptr to discard the output
+   *  @param[in]    len     Maximum bytes to decompress
+   *  @returns Bytes decompressed; fewer than len when the next token is
+   *           incomplete or the output is complete
+   */
+  size_t run(const uint8_t *&src, const uint8_t *src_end, uint8_t *dest,
+             size_t len)
+  {
+    const char *const name = mode == LZ10 ? "LZ10" : "LZ11";
+    const size_t mask_window = sizeof(window) - 1;
+
+    size_t out = 0;
+    while(out < len && pos < size)
+    {
+      if(remaining > 0)
+      {
+        // continue the current match
+        const size_t n = std::min(remaining, len - out);
+        for(size_t i = 0; i < n; ++i, ++pos)
+        {
+          const uint8_t c = window[(pos - disp) & mask_window];
+          window[pos & mask_window] = c;
+          if(dest)
+            dest[out + i] = c;
+        }
+        out       += n;
+        remaining -= n;
+        continue;
+      }
+
+      const size_t avail = src_end - src;
+
+      if(mask == 0)
+      {
+        if(avail == 0)
+          break;
+
+        // read in the flags data
+        // from bit 7 to bit 0:
+        //     0: raw byte
+        //     1: compressed block
+        flags = *src++;
+        mask  = 0x80;
+        continue;
+      }
+
+      if(flags & mask) // compressed block
+      {
+        if(avail == 0 || avail < (mode == LZ10 ? match_size<LZ10>(*src)
+                                               : match_size<LZ11>(*src)))
+          break;
+
+        size_t len;
+        disp = mode == LZ10 ? read_match<LZ10>(src, len)
+                            : read_match<LZ11>(src, len);
+
+        if(len > size - pos)
+        {
+          if(!printed_error)
+          {
+            std::fprintf(stderr, "Warning: Badly encoded %s stream; "
+                         "compressed block exceeds output length specified "
+                         "by header. Truncating output.\n", name);
+            printed_error = true;
+          }
+
+          // truncate output
+          len = size - pos;
+        }
+
+        if(disp > pos)
+          throw std::runtime_error(std::string("Error: Badly encoded ") +
+                                   name + " stream; encoded displacement "
+                                   "causes read prior to start of output "
+                                   "buffer.");
+
+        if(vram && disp == 1 && !printed_vram_error)
+        {
+          std::fprintf(stderr, "Warning: %s stream is not vram safe.\n", name);
+          printed_vram_error = true;
+        }
+
+        remaining = len;
+      }
+      else // uncompressed block
+      {
+        if(avail == 0)
+          break;
+
+        // copy a raw byte from the input to the output
+        window[pos++ & mask_window] = *src;
+        if(dest)
+          dest[out] = *src;
+        ++out;
+        ++src;
+      }
+
+      mask >>= 1;
+    }
+
+    return out;
+  }
+
+  uint8_t window[4096] = {};          ///< History ring
+  size_t  size = 0;                   ///< Uncompressed size
+  size_t  pos = 0;                    ///< Decompressed bytes so far
+  size_t  remaining = 0;              ///< Bytes left in the current match
+  size_t  disp = 0;                   ///< Displacement of the current match
+  LZSS_t  mode = LZ10;                ///< LZ mode
+  bool    vram = false;               ///< VRAM-safe
+  bool    printed_error = false;      ///< Truncation warned about
+  bool    printed_vram_error = false; ///< VRAM safety warned about
+  uint8_t flags = 0;                  ///< Current flag byte
+  uint8_t mask = 0;                   ///< Current flag mask
+};
+
+}
+
+/** @brief Length of the common prefix of two strings
+ *  @param[in] a   First string
+ *  @param[in] b   Second string
+ *  @param[in] len Maximum length to compare
+ *  @returns Length of common prefix
+ */
+size_t
+match_length(const uint8_t *a, const uint8_t *b, size_t len)
+{
+  // most candidates differ within the first word, so settle those inline
+  size_t n = match_length_word(a, b, std::min<size_t>(len, 8));
+  if(n < 8)
+    return n;
+
+  return n + match_length_impl(a + n, b + n, len - n);
+}
+
+/** @brief Find last instance of a byte in a buffer
+ *  @param[in] first Beginning of buffer
+ *  @param[in] last  End of buffer
+ *  @param[in] val   Byte to find
+ *
+ *  @returns iterator to found byte
+ *  @retval last if no match found
+ */
+Buffer::const_iterator
+rfind(Buffer::const_iterator first, Buffer::const_iterator last,
+      const uint8_t &val)
+{
+  assert(last >= first);
+
+  auto it = last;
+  while(--it >= first)
+  {
+    if(*it == val)
+      return it;
+  }
+
+  return last;
+}
+
+/** @brief Find best buffer match
+ *  @param[in]  source   Source buffer
+ *  @param[in]  it       Position in source buffer
+ *  @param[in]  len      Maximum length to match
+ *  @param[in]  max_disp Maximum displacement
+ *  @param[in]  vram     VRAM-safe
+ *  @param[out] outlen   Length of match
+ *  @returns Iterator to best match
+ *  @retval source.cend() for no match
+ */
+Buffer::const_iterator
+find_best_match(const Buffer &source, Buffer::const_iterator it, size_t len,
+                size_t max_disp, bool vram, size_t &outlen)
+{
+  auto begin = source.cbegin();
+  auto end   = source.cend();
+
+  assert(it > source.cbegin());
+  assert(it < source.cend());
+
+  // clamp start to maximum displacement from buffer
+  if(it - begin > static_cast<ptrdiff_t>(max_disp))
+    begin = it - max_disp;
+
+  // clamp len to end of buffer
+  if(end - it < static_cast<ptrdiff_t>(len))
+    len = end - it;
+
+  auto   best_start = it;
+  size_t best_len = 0;
+
+  // find nearest matching start byte
+  auto last_p = it;
+  auto p = rfind(begin, last_p, *it);
+  while(p != last_p)
+  {
+    // find length of match
+    size_t test_len = 1 + match_length(&*p + 1, &*it + 1, len - 1);
+
+    // vram requires displacement != 1
+    if(vram && (it - p) == 1)
+      test_len = 0;
+
+    if(test_len >= best_len)
+    {
+      // this match is the best so far, so save it
+      best_start = p;
+      best_len   = test_len;
+    }
+
+    // if we maximized the match, stop here
+    if(best_len == len)
+      break;
+
+    // find next nearest matching byte and try again
+    last_p = p;
+    p = rfind(begin, last_p, *it);
+  }
+
+  if(best_len)
+  {
+    // we found a match, so return it
+    outlen = best_len;
+    return best_start;
+  }
+
+  // no match found
+  outlen = 0;
+  return source.cend();
+}
+
+/** @brief Constructor
+ *  @param[in] source    Source buffer
+ *  @param[in] max_chain Maximum candidates examined per search
+ *                       (0 for unlimited)
+ */
+HashChain::HashChain(const Buffer &source, size_t max_chain)
+: source(source),
+  max_chain(max_chain),
+  prev(source.size(), HASH_NIL)
+{
+  std::vector<uint32_t> head(1 << HASH_BITS, HASH_NIL);
+
+  // link every position to the previous one sharing its prefix
+  for(size_t i = 0; i + 2 < source.size(); ++i)
+  {
+    uint32_t &h = head[hash3(&source[i])];
+    prev[i] = h;
+    h = i;
+  }
+}
+
+/** @brief Find best buffer match
+ *  @param[in]  it       Position in source buffer
+ *  @param[in]  len      Maximum length to match
+ *  @param[in]  max_disp Maximum displacement
+ *  @param[in]  vram     VRAM-safe
+ *  @param[out] outlen   Length of match
+ *  @returns Iterator to best match
+ *  @retval source.cend() for no match
+ */
+Buffer::const_iterator
+HashChain::find_best_match(Buffer::const_iterator it, size_t len,
+                           size_t max_disp, bool vram, size_t &outlen) const
+{
+  assert(it > source.cbegin());
+  assert(it < source.cend());
+
+  const size_t pos = it - source.cbegin();
+
+  // clamp len to end of buffer
+  if(source.size() - pos < len)
+    len = source.size() - pos;
+
+  // matches shorter than the prefix are never encoded
+  outlen = 0;
+  if(len < 3)
+    return source.cend();
+
+  const uint8_t *cur = &source[pos];
+  size_t best_pos = 0;
+  size_t best_len = 0;
+  size_t depth    = 0;
+
+  // walk the chain from nearest to farthest candidate
+  for(uint32_t p = prev[pos]; p != HASH_NIL && pos - p <= max_disp;
+      p = prev[p])
+  {
+    if(max_chain != 0 && depth++ == max_chain)
+      break;
+
+    // vram requires displacement != 1
+    if(vram && pos - p == 1)
+      continue;
+
+    // skip hash collisions
+    const uint8_t *cand = &source[p];
+    if(cand[0] != cur[0] || cand[1] != cur[1] || cand[2] != cur[2])
+      continue;
+
+    // find length of match
+    size_t test_len = 3 + match_length(cand + 3, cur + 3, len - 3);
+
+    // keep the same tie-breaking as find_best_match()
+    if(test_len >= best_len)
+    {
+      best_pos = p;
+      best_len = test_len;
+    }
+
+    // if we maximized the match, stop here
+    if(best_len == len)
+      break;
+  }
+
+  if(best_len)
+  {
+    // we found a match, so return it
+    outlen = best_len;
+    return source.cbegin() + best_pos;
+  }
+
+  // no match found
+  return source.cend();
+}
+
+/** @brief Constructor
+ *  @param[in] source    Source buffer
+ *  @param[in] max_len   Maximum match length
+ *  @param[in] max_disp  Maximum displacement
+ *  @param[in] vram      VRAM-safe
+ *  @param[in] threads   Number of threads
+ *  @param[in] complete  Find matches of any length up front
+ */
+SuffixArray::SuffixArray(const Buffer &source, size_t max_len,
+                         size_t max_disp, bool vram, size_t threads,
+                         bool complete)
+: source(source),
+  max_disp(max_disp),
+  vram(vram),
+  lens(source.size()),
+  disps(source.size())
+{
+  const size_t size = source.size();
+  assert(max_disp <= UINT16_MAX);
+
+  // blocks are independent, so sort them in parallel
+  parallel_for((size + SUFFIX_BLOCK - 1) / SUFFIX_BLOCK, threads,
+               [&](size_t block)
+  {
+    const size_t start = block * SUFFIX_BLOCK;
+
+    // sort the block along with its window and lookahead; a match as long
+    // as the sorted prefix is searched on demand
+    const size_t prefix = complete ? max_len
+                                    : std::min(max_len, SUFFIX_PREFIX);
+    const size_t end    = std::min(size, start + SUFFIX_BLOCK);
+    const size_t first  = start > max_disp ? start - max_disp : 0;
+    const size_t last   = std::min(size, end + prefix);
+    const size_t n      = last - first;
+
+    std::vector<uint32_t> sa, rank;
+    suffix_sort(&source[first], n, prefix, sa, rank);
+
+    // lcp[r] is the common prefix of ranks r-1 and r (Kasai), up to the
+    // sorted prefix; past a tie the next suffixes may be in either order, and
+    // are compared afresh if they are swapped
+    std::vector<uint32_t> lcp(n);
+    for(size_t i = 0, h = 0; i < n; ++i)
+    {
+      if(rank[i] == 0)
+      {
+        h = 0;
+        continue;
+      }
+
+      size_t j = sa[rank[i] - 1];
+      h += match_length(source.data() + first + i + h,
+                        source.data() + first + j + h,
+                        std::min(n - std::max(i, j), prefix) - h);
+      lcp[rank[i]] = h;
+      if(h == prefix && rank[j + 1] > rank[i + 1])
+        h = 0;
+      else if(h > 0)
+        --h;
+    }
+
+    SparseTable table(lcp);
+    RankTree    window(n);
+
+    // common prefix of two ranks
+    auto common = [&](size_t a, size_t b)
+    {
+      return a < b ? table.min(a+1, b) : table.min(b+1, a);
+    };
+
+    // positions before the block are already in the window, except the
+    // immediately preceding one which is added by the loop
+    for(size_t j = first; j + 1 < start; ++j)
+      window.set(rank[j - first], j);
+
+    for(size_t i = start; i < end; ++i)
+    {
+      // slide the window
+      if(i > first + max_disp)
+        window.set(rank[i - max_disp - 1 - first], -1);
+
+      // vram requires displacement != 1
+      if(i > 0 && !vram)
+        window.set(rank[i - 1 - first], i - 1);
+
+      const size_t cap = std::min(max_len, size - i);
+      const size_t r   = rank[i - first];
+
+      // suffixes sharing the whole sorted prefix are ordered by position, so
+      // the nearest of them ranks just below this one
+      ptrdiff_t tied = -1;
+      if(r > 0 && lcp[r] >= prefix)
+      {
+        tied = first + sa[r-1];
+        if(vram && size_t(tied) + 1 == i)
+          tied = r > 1 && lcp[r-1] >= prefix ? first + sa[r-2] : -1;
+      }
+
+      if(tied >= 0 && i - tied <= max_disp)
+      {
+        // a match no shorter than the sorted prefix; it is the nearest
+        // full-length match unless longer matches are possible
+        if(prefix < cap)
+          lens[i] = MATCH_UNKNOWN;
+        else
+        {
+          lens[i]  = cap;
+          disps[i] = i - tied;
+        }
+      }
+      else
+      {
+        // the longest match is next to this suffix in rank order
+        size_t best = 0;
+        ptrdiff_t below = window.below(r);
+        ptrdiff_t above = window.above(r);
+        if(below >= 0)
+          best = std::max<size_t>(best, common(below, r));
+        if(above >= 0)
+          best = std::max<size_t>(best, common(r, above));
+
+        if(best >= std::min(prefix, last - i) && best < cap)
+          lens[i] = MATCH_UNKNOWN;
+        else if((best = std::min(best, cap)) >= 3)
+        {
+          // find the rank range sharing the best prefix
+          const size_t lo = table.lower(r, best) - 1;
+          const size_t hi = table.upper(r + 1, best);
+
+          // full-length matches prefer the nearest candidate and shorter
+          // matches the farthest, just like find_best_match()
+          int32_t nearest, farthest;
+          window.range(lo, hi, nearest, farthest);
+          lens[i]  = best;
+          disps[i] = i - (best == cap ? nearest : farthest);
+        }
+      }
+
+      if(i > 0 && vram)
+        window.set(rank[i - 1 - first], i - 1);
+    }
+  });
+}
+
+/** @brief Find best buffer match
+ *  @param[in]  it     Position in source buffer
+ *  @param[in]  len    Maximum length to match
+ *  @param[out] outlen Length of match
+ *  @returns Iterator to best match
+ *  @retval source.cend() for no match
+ */
+Buffer::const_iterator
+SuffixArray::find_best_match(Buffer::const_iterator it, size_t len,
+                             size_t &outlen) const
+{
+  assert(it > source.cbegin());
+  assert(it < source.cend());
+
+  const size_t pos = it - source.cbegin();
+
+  // positions left out of the table are searched directly
+  if(lens[pos] == MATCH_UNKNOWN)
+  {
+    auto match = gbalzss::find_best_match(source, it, len, max_disp, vram,
+                                          outlen);
+    if(outlen < 3)
+    {
+      outlen = 0;
+      return source.cend();
+    }
+    return match;
+  }
+
+  // matches were computed against the full remaining length; a shorter
+  // limit still leaves a valid prefix match
+  outlen = std::min<size_t>(lens[pos], len);
+  if(outlen == 0)
+    return source.cend();
+
+  return it - disps[pos];
+}
+
+/** @brief Output a GBA-style compression header
+ *  @param[out] header Output header
+ *  @param[in]  type   Compression type
+ *  @param[in]  size   Uncompressed data size
+ */
+void
+header(Buffer &buffer, uint8_t type, size_t size)
+{
+  buffer.resize(buffer.size() + 4);
+  header(buffer.data() + buffer.size() - 4, type, size);
+}
+
+/** @brief Output a GBA-style compression header
+ *  @param[out] header Output header (4 bytes)
+ *  @param[in]  type   Compression type
+ *  @param[in]  size   Uncompressed data size
+ */
+void
+header(uint8_t *buffer, uint8_t type, size_t size)
+{
+  buffer[0] = type;
+  buffer[1] = size >>  0;
+  buffer[2] = size >>  8;
+  buffer[3] = size >> 16;
+}
+
+/** @brief Worst-case compressed size
+ *  @param[in] size Uncompressed data size
+ *  @returns Compressed size if every byte is encoded uncompressed
+ */
+size_t
+max_encoded_size(size_t size)
+{
+  // header, one flag byte per eight tokens (at least one), the bytes
+  // themselves, padded to 4 bytes
+  const size_t flags = std::max<size_t>((size + 7) / 8, 1);
+  return (4 + flags + size + 3) & ~static_cast<size_t>(0x3);
+}
+
+/** @brief Uncompressed size from a compression header
+ *  @param[in] source Compressed data
+ *  @param[in] len    Compressed data length
+ *  @returns Uncompressed data size
+ */
+size_t
+decoded_size(const uint8_t *source, size_t len)
+{
+  if(len < 4 || (source[0] != LZ10 && source[0] != LZ11))
+    throw std::runtime_error("Error: Invalid LZSS header");
+
+  return source[1] | (source[2] << 8) | (source[3] << 16);
+}
+
+/** @brief Uncompressed size from a compression header
+ *  @param[in] source Compressed buffer
+ *  @returns Uncompressed data size
+ */
+size_t
+decoded_size(const Buffer &source)
+{
+  return decoded_size(source.data(), source.size());
+}
+
+/** @brief LZ10/LZ11 compression
+ *  @param[in] source Source buffer
+ *  @param[in] mode   LZ mode
+ *  @param[in] vram   VRAM-safe
+ *  @returns Compressed buffer
+ */
+Buffer
+lzss_encode(const Buffer &source, LZSS_t mode, bool vram)
+{
+  return lzss_encode(source, mode, vram, EncodeOptions());
+}
+
+/** @brief LZ10/LZ11 compression
+ *  @param[in] source  Source buffer
+ *  @param[in] mode    LZ mode
+ *  @param[in] vram    VRAM-safe
+ *  @param[in] options Encoder options
+ *  @returns Compressed buffer
+ */
+Buffer
+lzss_encode(const Buffer &source, LZSS_t mode, bool vram,
+            const EncodeOptions &options)
+{
+  // size the output buffer once for the worst case
+  Buffer result(max_encoded_size(source.size()));
+
+  result.resize(lzss_encode(source, mode, vram, result.data(), result.size(),
+                            options));
+
+  // return the output data
+  return result;
+}
+
+/** @brief LZ10/LZ11 compression into a caller-provided region
+ *  @param[in]  source   Source buffer
+ *  @param[in]  mode     LZ mode
+ *  @param[in]  vram     VRAM-safe
+ *  @param[out] dest     Output region
+ *  @param[in]  dest_len Output region size
+ *  @param[in]  options  Encoder options
+ *  @returns Compressed length
+ */
+size_t
+lzss_encode(const Buffer &source, LZSS_t mode, bool vram, uint8_t *dest,
+            size_t dest_len, const EncodeOptions &options)
+{
+  // write compression header
+  if(dest_len < 4)
+    throw std::runtime_error("Error: Output buffer too small");
+
+  header(dest, mode, source.size());
+
+  // encode every byte
+  TokenWriter writer(dest, dest_len, 4, mode);
+  encode(source, 0, mode, vram, options, writer);
+
+  // pad the output buffer to 4 bytes
+  return writer.finish();
+}
+
+/** @brief Compression with whichever of LZ10 and LZ11 is smaller
+ *  @param[in] source  Source buffer
+ *  @param[in] vram    VRAM-safe
+ *  @param[in] options Encoder options
+ *  @param[in] prefer  Format kept when both are the same size
+ *  @returns Compressed buffer
+ */
+Buffer
+lzss_encode_auto(const Buffer &source, bool vram, const EncodeOptions &options,
+                 LZSS_t prefer)
+{
+  // encode LZ11 on a second thread while this one encodes LZ10
+  Buffer lz11;
+  std::exception_ptr error;
+  std::thread worker([&]
+  {
+    try
+    {
+      lz11 = lzss_encode(source, LZ11, vram, options);
+    }
+    catch(...)
+    {
+      error = std::current_exception();
+    }
+  });
+
+  Buffer lz10;
+  try
+  {
+    lz10 = lzss_encode(source, LZ10, vram, options);
+  }
+  catch(...)
+  {
+    worker.join();
+    throw;
+  }
+
+  worker.join();
+  if(error)
+    std::rethrow_exception(error);
+
+  if(lz10.size() == lz11.size())
+    return prefer == LZ11 ? lz11 : lz10;
+
+  return lz10.size() < lz11.size() ? lz10 : lz11;
+}
+
+/** @brief Re-encode an edited source, reusing the previous stream
+ *  @param[in] old_source Previous source buffer
+ *  @param[in] old_stream Previous compressed buffer
+ *  @param[in] source     Source buffer
+ *  @param[in] vram       VRAM-safe
+ *  @param[in] options    Encoder options
+ *  @returns Compressed buffer
+ */
+Buffer
+lzss_reencode(const Buffer &old_source, const Buffer &old_stream,
+              const Buffer &source, bool vram, const EncodeOptions &options)
+{
+  // the previous stream must actually encode the previous source
+  Buffer check(decoded_size(old_stream));
+  lzss_decode(old_stream.data(), old_stream.size(), check.data(), check.size(),
+              false);
+  if(check != old_source)
+    throw std::runtime_error("Error: Stream does not match previous source");
+
+  const LZSS_t mode = static_cast<LZSS_t>(old_stream[0]);
+
+  // a size budget applies to the whole stream, which a partial re-encode
+  // cannot guarantee
+  if(options.size_budget)
+    return lzss_encode(source, mode, vram, options);
+
+  std::vector<Token> tokens;
+  read_tokens(old_stream, tokens);
+
+  // find the unchanged prefix and suffix
+  const size_t size     = source.size();
+  const size_t old_size = old_source.size();
+  const size_t common   = std::min(size, old_size);
+
+  size_t prefix = 0;
+  while(prefix < common && source[prefix] == old_source[prefix])
+    ++prefix;
+
+  size_t suffix = 0;
+  while(suffix < common - prefix
+     && source[size - 1 - suffix] == old_source[old_size - 1 - suffix])
+    ++suffix;
+
+  // VRAM-safe output cannot reuse copies from one byte back
+  auto reusable = [&](const Token &token)
+  {
+    return !vram || token.len == 1 || token.disp >= 2;
+  };
+
+  Buffer result(max_encoded_size(size));
+  header(result.data(), mode, size);
+  TokenWriter writer(result.data(), result.size(), 4, mode);
+
+  // reuse the tokens ending before the first change
+  size_t pos = 0, next = 0;
+  while(next < tokens.size() && pos + tokens[next].len <= prefix
+     && reusable(tokens[next]))
+  {
+    if(tokens[next].len == 1)
+      writer.literal(source[pos]);
+    else
+      writer.match(tokens[next].len, tokens[next].disp);
+    pos += tokens[next++].len;
+  }
+
+  // resynchronize at the first old token boundary whose whole window lies in
+  // the unchanged suffix; every token after it copies the same bytes
+  const size_t max_disp = mode == LZ10 ? LZ10_MAX_DISP : LZ11_MAX_DISP;
+  size_t sync = tokens.size(), sync_pos = size;
+  for(size_t i = tokens.size(), q = old_size; i-- > next; )
+  {
+    if(!reusable(tokens[i]))
+      break;
+
+    q -= tokens[i].len;
+    if(q < old_size - suffix + max_disp || q + size - old_size < pos)
+      break;
+
+    sync     = i;
+    sync_pos = q + size - old_size;
+  }
+
+  // re-encode the changed region against the window preceding it
+  if(pos < sync_pos)
+  {
+    const size_t base = pos > max_disp ? pos - max_disp : 0;
+    const Buffer region(source.begin() + base, source.begin() + sync_pos);
+
+    encode(region, pos - base, mode, vram, options, writer);
+  }
+
+  // reuse the tokens after the resynchronization point
+  for(pos = sync_pos; sync < tokens.size(); pos += tokens[sync++].len)
+  {
+    if(tokens[sync].len == 1)
+      writer.literal(source[pos]);
+    else
+      writer.match(tokens[sync].len, tokens[sync].disp);
+  }
+
+  // pad the output buffer to 4 bytes
+  result.resize(writer.finish());
+  return result;
+}
+
+/** @brief LZ10/LZ11 compressed size
+ *  @param[in] source Source buffer
+ *  @param[in] mode   LZ mode
+ *  @param[in] vram   VRAM-safe
+ *  @returns Compressed length
+ */
+size_t
+lzss_encoded_size(const Buffer &source, LZSS_t mode, bool vram)
+{
+  return lzss_encoded_size(source, mode, vram, EncodeOptions());
+}
+
+/** @brief LZ10/LZ11 compressed size
+ *  @param[in] source  Source buffer
+ *  @param[in] mode    LZ mode
+ *  @param[in] vram    VRAM-safe
+ *  @param[in] options Encoder options
+ *  @returns Compressed length
+ */
+size_t
+lzss_encoded_size(const Buffer &source, LZSS_t mode, bool vram,
+                  const EncodeOptions &options)
+{
+  // run the same parse, only counting the tokens
+  TokenCounter counter(mode);
+  encode(source, 0, mode, vram, options, counter);
+
+  return counter.finish();
+}
+
+/** @brief LZ10 compression
+ *  @param[in] source Source buffer
+ *  @param[in] vram   VRAM-safe
+ *  @returns Compressed buffer
+ */
+Buffer
+lz10_encode(const Buffer &source, bool vram)
+{
+  return lzss_encode(source, LZ10, vram);
+}
+
+/** @brief LZ11 compression
+ *  @param[in] source Source buffer
+ *  @param[in] vram   VRAM-safe
+ *  @returns Compressed buffer
+ */
+Buffer
+lz11_encode(const Buffer &source, bool vram)
+{
+  return lzss_encode(source, LZ11, vram);
+}
+
+/** @brief Stream encoder state */
+struct StreamEncoder::State
+{
+  /** @brief Constructor
+   *  @param[in] mode    LZ mode
+   *  @param[in] vram    VRAM-safe
+   *  @param[in] options Encoder options
+   *  @param[in] size    Uncompressed data size written to the header
+   */
+  State(LZSS_t mode, bool vram, const EncodeOptions &options, size_t size)
+  : mode(mode),
+    vram(vram),
+    options(options),
+    output(max_encoded_size(STREAM_BLOCK) + 64),
+    writer(output.data(), output.size(), 4, mode)
+  {
+    // blocks are parsed separately, so a size budget cannot be met
+    if(options.size_budget)
+      throw std::runtime_error("Error: A size budget needs the whole input; "
+                               "it cannot be used when streaming");
+
+    header(output.data(), mode, size);
+  }
+
+  /** @brief Encode the buffered block and hand out the completed output
+   *  @param[out] out Compressed output
+   */
+  void flush(Buffer &out)
+  {
+    if(data.size() > first)
+      encode(data, first, mode, vram, options, writer);
+
+    // the current flag byte and its tokens stay until the next block
+    const size_t len = writer.complete() & ~static_cast<size_t>(0x3);
+    out.insert(out.end(), output.begin(), output.begin() + len);
+    writer.discard(len);
+
+    // keep the window for the next block
+    const size_t window = mode == LZ10 ? LZ10_MAX_DISP : LZ11_MAX_DISP;
+    if(data.size() > window)
+      data.erase(data.begin(), data.end() - window);
+    first = data.size();
+  }
+
+  LZSS_t        mode;      ///< LZ mode
+  bool          vram;      ///< VRAM-safe
+  EncodeOptions options;   ///< Encoder options
+  Buffer        data;      ///< Window followed by the current block
+  size_t        first = 0; ///< Start of the current block in data
+  size_t        total = 0; ///< Uncompressed bytes received
+  Buffer        output;    ///< Pending compressed output
+  TokenWriter   writer;    ///< Token writer over output
+};
+
+/** @brief Constructor
+ *  @param[in] mode    LZ mode
+ *  @param[in] vram    VRAM-safe
+ *  @param[in] options Encoder options
+ */
+StreamEncoder::StreamEncoder(LZSS_t mode, bool vram,
+                             const EncodeOptions &options)
+: state(new State(mode, vram, options, 0)),
+  size(0),
+  known(false)
+{
+}
+
+/** @brief Constructor
+ *  @param[in] mode    LZ mode
+ *  @param[in] vram    VRAM-safe
+ *  @param[in] options Encoder options
+ *  @param[in] size    Uncompressed data size
+ */
+StreamEncoder::StreamEncoder(LZSS_t mode, bool vram,
+                             const EncodeOptions &options, size_t size)
+: state(new State(mode, vram, options, size)),
+  size(size),
+  known(true)
+{
+  if(size > LZSS_MAX_ENCODE_LEN)
+    throw std::runtime_error("Error: Input file too large.\n");
+}
+
+/** @brief Destructor */
+StreamEncoder::~StreamEncoder()
+{
+}
+
+/** @brief Compress a chunk of input
+ *  @param[in]  data Input chunk
+ *  @param[in]  len  Input chunk length
+ *  @param[out] out  Compressed output (appended)
+ */
+void
+StreamEncoder::write(const uint8_t *data, size_t len, Buffer &out)
+{
+  State &st = *state;
+
+  if(st.total + len > (known ? size : LZSS_MAX_ENCODE_LEN))
+    throw std::runtime_error("Error: Input file too large.\n");
+
+  st.total += len;
+  while(len > 0)
+  {
+    // fill the current block
+    const size_t n = std::min(len, st.first + STREAM_BLOCK - st.data.size());
+    st.data.insert(st.data.end(), data, data + n);
+    data += n;
+    len  -= n;
+
+    if(st.data.size() - st.first == STREAM_BLOCK)
+      st.flush(out);
+  }
+}
+
+/** @brief Compress the remaining input and pad the output
+ *  @param[out] out Compressed output (appended)
+ */
+void
+StreamEncoder::finish(Buffer &out)
+{
+  State &st = *state;
+
+  if(known && st.total != size)
+    throw std::runtime_error("Error: Input shorter than expected");
+
+  st.flush(out);
+
+  // pad the output buffer to 4 bytes
+  const size_t len = st.writer.finish();
+  out.insert(out.end(), st.output.begin(), st.output.begin() + len);
+}
+
+/** @brief Final compression header
+ *  @param[out] buffer Output header (4 bytes)
+ */
+void
+StreamEncoder::size_header(uint8_t *buffer) const
+{
+  header(buffer, state->mode, state->total);
+}
+
+/** @brief Estimated BIOS decode cycles
+ *  @param[in] source Compressed data
+ *  @param[in] len    Compressed data length
+ *  @returns Estimated cycles for LZ77UnCompVram
+ */
+size_t
+decode_cycles(const uint8_t *source, size_t len)
+{
+  size_t size = decoded_size(source, len);
+  size_t pos  = 4;
+
+  const bool lz11 = source[0] == LZ11;
+
+  // halfword stores
+  size_t cycles = CYCLES_HEADER + (size + 1) / 2 * CYCLES_WRITE;
+
+  uint8_t flags = 0;
+  uint8_t mask  = 0;
+  while(size > 0)
+  {
+    if(pos >= len)
+      throw std::runtime_error("Error: Truncated LZSS stream");
+
+    if(mask == 0)
+    {
+      cycles += CYCLES_FLAG;
+      flags = source[pos++];
+      mask  = 0x80;
+      continue;
+    }
+
+    if(flags & mask) // compressed block
+    {
+      size_t len_bytes = 2;
+      size_t count     = (source[pos] >> 4) + 3;
+      if(lz11)
+      {
+        const size_t indicator = source[pos] >> 4;
+        len_bytes = indicator == 0 ? 3 : indicator == 1 ? 4 : 2;
+        if(pos + len_bytes > len)
+          throw std::runtime_error("Error: Truncated LZSS stream");
+
+        if(indicator == 0)
+          count = ((source[pos] << 4) | (source[pos+1] >> 4)) + 0x11;
+        else if(indicator == 1)
+          count = (((source[pos] & 0x0F) << 12) | (source[pos+1] << 4)
+                | (source[pos+2] >> 4)) + 0x111;
+        else
+          count = indicator + 1;
+      }
+
+      count = std::min(count, size);
+      cycles += CYCLES_MATCH + (len_bytes - 2) * CYCLES_EXTEND
+              + count * CYCLES_COPY;
+      pos  += len_bytes;
+      size -= count;
+    }
+    else // uncompressed block
+    {
+      cycles += CYCLES_LITERAL;
+      ++pos;
+      --size;
+    }
+
+    mask >>= 1;
+  }
+
+  return cycles;
+}
+
+/** @brief Estimated BIOS decode cycles
+ *  @param[in] source Compressed buffer
+ *  @returns Estimated cycles for LZ77UnCompVram
+ */
+size_t
+decode_cycles(const Buffer &source)
+{
+  return decode_cycles(source.data(), source.size());
+}
+
+/** @brief LZ10/LZ11 Decompression into a caller-provided region
+ *  @param[in]  source   Compressed data
+ *  @param[in]  len      Compressed data length
+ *  @param[out] dest     Output region
+ *  @param[in]  dest_len Output region size
+ *  @param[in]  vram     VRAM-safe
+ *  @returns Decompressed length
+ */
+size_t
+lzss_decode(const uint8_t *source, size_t len, uint8_t *dest, size_t dest_len,
+            bool vram)
+{
+  const DecodeResult result = lzss_try_decode(source, len, dest, dest_len,
+                                              vram);
+  throw_status(source, result);
+
+  const char *name = source[0] == LZ10 ? "LZ10" : "LZ11";
+  if(result.overrun)
+  {
+    std::fprintf(stderr, "Warning: Badly encoded %s stream; compressed "
+                 "block exceeds output length specified by header. "
+                 "Truncating output.\n", name);
+  }
+
+  if(result.vram_unsafe)
+    std::fprintf(stderr, "Warning: %s stream is not vram safe.\n", name);
+
+  return result.size;
+}
+
+/** @brief LZ10/LZ11 Decompression without exceptions or diagnostics
+ *  @param[in]  source   Compressed data
+ *  @param[in]  len      Compressed data length
+ *  @param[out] dest     Output region
+ *  @param[in]  dest_len Output region size
+ *  @param[in]  vram     VRAM-safe
+ *  @returns Outcome
+ */
+DecodeResult
+lzss_try_decode(const uint8_t *source, size_t len, uint8_t *dest,
+                size_t dest_len, bool vram)
+{
+  DecodeResult result;
+
+  if(len < 4 || (source[0] != LZ10 && source[0] != LZ11))
+  {
+    result.status = STATUS_BAD_HEADER;
+    return result;
+  }
+
+  const size_t size = source[1] | (source[2] << 8) | (source[3] << 16);
+  if(dest_len < size)
+  {
+    result.status = STATUS_OUTPUT_TOO_SMALL;
+    return result;
+  }
+
+  const uint8_t *last = source + len;
+  if(source[0] == LZ10)
+  {
+    if(vram)
+      decode<LZ10, true>(source, last, dest, size, result);
+    else
+      decode<LZ10, false>(source, last, dest, size, result);
+  }
+  else
+  {
+    if(vram)
+      decode<LZ11, true>(source, last, dest, size, result);
+    else
+      decode<LZ11, false>(source, last, dest, size, result);
+  }
+
+  return result;
+}
+
+/** @brief Validate an LZ10/LZ11 stream without decompressing it
+ *  @param[in] source Compressed data
+ *  @param[in] len    Compressed data length
+ *  @returns Compressed bytes consumed, including the header
+ */
+size_t
+lzss_validate(const uint8_t *source, size_t len)
+{
+  const DecodeResult result = lzss_try_validate(source, len);
+  throw_status(source, result);
+
+  return result.position;
+}
+
+/** @brief Validate an LZ10/LZ11 stream without exceptions or diagnostics
+ *  @param[in] source Compressed data
+ *  @param[in] len    Compressed data length
+ *  @returns Outcome
+ */
+DecodeResult
+lzss_try_validate(const uint8_t *source, size_t len)
+{
+  DecodeResult result;
+
+  if(len < 4 || (source[0] != LZ10 && source[0] != LZ11))
+  {
+    result.status = STATUS_BAD_HEADER;
+    return result;
+  }
+
+  const size_t size = source[1] | (source[2] << 8) | (source[3] << 16);
+  if(source[0] == LZ10)
+    validate<LZ10>(source, source + len, size, result);
+  else
+    validate<LZ11>(source, source + len, size, result);
+
+  return result;
+}
+
+/** @brief LZ10/LZ11 Decompression directly into a file
+ *  @param[in] source Compressed data
+ *  @param[in] len    Compressed data length
+ *  @param[in] path   Output file path
+ *  @param[in] vram   VRAM-safe
+ *  @returns Decompressed length
+ */
+size_t
+lzss_decode_file(const uint8_t *source, size_t len, const char *path,
+                 bool vram)
+{
+  const size_t size = decoded_size(source, len);
+
+  int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0)
+    throw std::runtime_error(std::string("Error: Failed to open '") + path +
+                             "' for writing");
+
+  // an empty mapping is invalid; the empty file is already the output
+  if(size == 0)
+  {
+    ::close(fd);
+    return 0;
+  }
+
+  void *map = MAP_FAILED;
+  if(::ftruncate(fd, size) == 0)
+    map = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+
+  if(map == MAP_FAILED)
+    throw std::runtime_error(std::string("Error: Failed to map '") + path +
+                             "'");
+
+  try
+  {
+    lzss_decode(source, len, static_cast<uint8_t*>(map), size, vram);
+  }
+  catch(...)
+  {
+    ::munmap(map, size);
+    throw;
+  }
+
+  ::munmap(map, size);
+  return size;
+}
+
+/** @brief Stream decoder state */
+struct StreamDecoder::State
+{
+  DecodeState decoder;          ///< Decoder state
+  Buffer      input;            ///< Buffered compressed input
+  size_t      consumed = 0;     ///< Consumed bytes of input
+  bool        started = false;  ///< Whether the header has been read
+};
+
+/** @brief Constructor
+ *  @param[in] vram VRAM-safe
+ */
+StreamDecoder::StreamDecoder(bool vram)
+: state(new State)
+{
+  state->decoder.vram = vram;
+}
+
+/** @brief Destructor */
+StreamDecoder::~StreamDecoder()
+{
+}
+
+/** @brief Feed a chunk of compressed input
+ *  @param[in] data Input chunk
+ *  @param[in] len  Input chunk length
+ */
+void
+StreamDecoder::write(const uint8_t *data, size_t len)
+{
+  State &st = *state;
+
+  st.input.insert(st.input.end(), data, data + len);
+
+  if(!st.started && st.input.size() >= 4)
+  {
+    st.decoder.size = decoded_size(st.input.data(), st.input.size());
+    st.decoder.mode = static_cast<LZSS_t>(st.input[0]);
+    st.consumed     = 4;
+    st.started      = true;
+  }
+}
+
+/** @brief Decompress buffered input
+ *  @param[out] dest Output region
+ *  @param[in]  len  Maximum bytes to decompress
+ *  @returns Bytes decompressed
+ */
+size_t
+StreamDecoder::read(uint8_t *dest, size_t len)
+{
+  State &st = *state;
+
+  if(!st.started)
+    return 0;
+
+  const uint8_t *src = st.input.data() + st.consumed;
+  const size_t   n   = st.decoder.run(src, st.input.data() + st.input.size(),
+                                      dest, len);
+  st.consumed = src - st.input.data();
 
-  if(best_len)
+  // drop consumed input once it outweighs what is left
+  if(st.consumed > st.input.size() / 2)
   {
-    // we found a match, so return it
-    outlen = best_len;
-    return best_start;
+    st.input.erase(st.input.begin(), st.input.begin() + st.consumed);
+    st.consumed = 0;
   }
 
-  // no match found
-  outlen = 0;
-  return source.cend();
+  return n;
 }
 
-/** @brief Output a GBA-style compression header
- *  @param[out] header Output header
- *  @param[in]  type   Compression type
- *  @param[in]  size   Uncompressed data size
+/** @brief Uncompressed size
+ *  @returns Size from the header, or 0 until the header has been read
  */
-void
-header(Buffer &buffer, uint8_t type, size_t size)
+size_t
+StreamDecoder::size() const
 {
-  buffer.push_back(type);
-  buffer.push_back(size >>  0);
-  buffer.push_back(size >>  8);
-  buffer.push_back(size >> 16);
+  return state->decoder.size;
 }
 
-/** @brief LZ10/LZ11 compression
- *  @param[in] source Source buffer
- *  @param[in] mode   LZ mode
- *  @param[in] vram   VRAM-safe
- *  @returns Compressed buffer
+/** @brief Whether the whole output has been decompressed
+ *  @returns Whether the output is complete
  */
-Buffer
-lzss_encode(const Buffer &source, LZSS_t mode, bool vram)
+bool
+StreamDecoder::done() const
 {
-  // get maximum match length
-  const size_t max_len  = mode == LZ10 ? LZ10_MAX_LEN  : LZ11_MAX_LEN;
-
-  // get maximum displacement
-  const size_t max_disp = mode == LZ10 ? LZ10_MAX_DISP : LZ11_MAX_DISP;
+  return state->started && state->decoder.pos == state->decoder.size;
+}
 
-  assert(mode == LZ10 || mode == LZ11);
+/** @brief Build a checkpoint index over a compressed stream
+ *  @param[in] source   Compressed data
+ *  @param[in] len      Compressed data length
+ *  @param[in] interval Uncompressed bytes between checkpoints
+ *  @returns Checkpoint index
+ */
+CheckpointIndex
+checkpoint_index(const uint8_t *source, size_t len, size_t interval)
+{
+  if(interval == 0)
+    throw std::runtime_error("Error: Invalid checkpoint interval");
 
-  // create output buffer
-  Buffer result;
+  DecodeState st;
+  st.size = decoded_size(source, len);
+  st.mode = static_cast<LZSS_t>(source[0]);
 
-  // append compression header
-  header(result, mode, source.size());
+  CheckpointIndex index;
+  index.size     = st.size;
+  index.interval = interval;
 
-  // reserve an encode byte in output buffer
-  size_t code_pos = result.size();
-  result.push_back(0);
+  const uint8_t *src = source + 4;
+  do
+  {
+    Checkpoint checkpoint;
+    checkpoint.output    = st.pos;
+    checkpoint.source    = src - source;
+    checkpoint.remaining = st.remaining;
+    checkpoint.disp      = st.disp;
+    checkpoint.flags     = st.flags;
+    checkpoint.mask      = st.mask;
+    checkpoint.window.assign(st.window, st.window + sizeof(st.window));
+    index.checkpoints.push_back(std::move(checkpoint));
+
+    const size_t n = std::min(interval, st.size - st.pos);
+    if(st.run(src, source + len, nullptr, n) != n)
+      throw std::runtime_error("Error: Truncated LZSS stream");
+  } while(st.pos < st.size);
+
+  return index;
+}
 
-  // initialize shift
-  size_t shift = 8;
+/** @brief Decompress part of a stream starting from the nearest checkpoint
+ *  @param[in]  source Compressed data
+ *  @param[in]  len    Compressed data length
+ *  @param[in]  index  Checkpoint index for the stream
+ *  @param[in]  first  Uncompressed offset to start at
+ *  @param[out] dest   Output region
+ *  @param[in]  count  Bytes to decompress
+ *  @param[in]  vram   VRAM-safe
+ *  @returns Bytes decompressed
+ */
+size_t
+checkpoint_decode(const uint8_t *source, size_t len,
+                  const CheckpointIndex &index, size_t first, uint8_t *dest,
+                  size_t count, bool vram)
+{
+  DecodeState st;
+  st.size = decoded_size(source, len);
+  st.mode = static_cast<LZSS_t>(source[0]);
+  st.vram = vram;
+
+  if(index.size != st.size || index.checkpoints.empty())
+    throw std::runtime_error("Error: Checkpoint index does not match stream");
+  if(first > st.size)
+    throw std::runtime_error("Error: Offset past end of output");
+
+  count = std::min(count, st.size - first);
+
+  const Checkpoint &checkpoint =
+    index.checkpoints[std::min(first / index.interval,
+                               index.checkpoints.size() - 1)];
+  if(checkpoint.source > len || checkpoint.window.size() != sizeof(st.window))
+    throw std::runtime_error("Error: Checkpoint index does not match stream");
+
+  st.pos       = checkpoint.output;
+  st.remaining = checkpoint.remaining;
+  st.disp      = checkpoint.disp;
+  st.flags     = checkpoint.flags;
+  st.mask      = checkpoint.mask;
+  std::copy(checkpoint.window.begin(), checkpoint.window.end(), st.window);
+
+  // skip to the requested offset, then decode the range
+  const uint8_t *src  = source + checkpoint.source;
+  const size_t   skip = first - st.pos;
+  if(st.run(src, source + len, nullptr, skip) != skip
+  || st.run(src, source + len, dest, count) != count)
+    throw std::runtime_error("Error: Truncated LZSS stream");
+
+  return count;
+}
 
-  // encode every byte
-  auto it = source.cbegin();
-  auto end = source.cend();
-  while(it < end)
-  {
-    if(shift == 0)
-    {
-      // we need to encode more data, so add a new code byte
-      shift = 8;
-      code_pos = result.size();
-      result.push_back(0);
-    }
+/** @brief Serialize a checkpoint index
+ *  @param[in] index Checkpoint index
+ *  @returns Serialized index
+ */
+Buffer
+checkpoint_export(const CheckpointIndex &index)
+{
+  Buffer result(LZSS_INDEX_HEADER +
+                index.checkpoints.size() * LZSS_INDEX_RECORD);
 
-    // advance code byte bit position
-    if(shift != 0)
-      --shift;
+  std::memcpy(result.data(), LZSS_INDEX_MAGIC, 4);
+  write32(result.data() + 4,  index.size);
+  write32(result.data() + 8,  index.interval);
+  write32(result.data() + 12, index.checkpoints.size());
 
-    const size_t len = end - it;
-    auto         tmp = source.cend();
-    size_t       tmplen = 0;
+  uint8_t *record = result.data() + LZSS_INDEX_HEADER;
+  for(const auto &checkpoint : index.checkpoints)
+  {
+    write32(record + 0, checkpoint.source);
+    write32(record + 4, checkpoint.remaining);
+    write32(record + 8, checkpoint.disp);
+    record[12] = checkpoint.flags;
+    record[13] = checkpoint.mask;
+    std::copy(checkpoint.window.begin(), checkpoint.window.end(), record + 16);
+    record += LZSS_INDEX_RECORD;
+  }
 
-    if(it == source.cbegin())
-    {
-      // beginning of stream must be primed with at least one value
-      tmplen = 1;
-    }
-    else
-    {
-      // find best match
-      tmp = find_best_match(source, it, std::min(len, max_len), max_disp, vram,
-                            tmplen);
-      if(tmp != source.cend())
-      {
-        assert(!vram || tmp - it != 1);
-        assert(tmp >= source.cbegin());
-        assert(tmp < it);
-        assert(it - tmp <= static_cast<ptrdiff_t>(max_disp));
-        assert(tmplen <= max_len);
-        assert(tmplen <= len);
-        assert(std::equal(it, it+tmplen, tmp));
-      }
-    }
+  return result;
+}
 
-    if(tmplen > 2 && tmplen < len)
-    {
-      // this match is long enough to be compressed; let's check if it's
-      // cheaper to encode this byte as a copy and start compression at the
-      // next byte
-      size_t skip_len, next_len;
+/** @brief Deserialize a checkpoint index
+ *  @param[in] source Serialized index
+ *  @returns Checkpoint index
+ */
+CheckpointIndex
+checkpoint_import(const Buffer &source)
+{
+  if(source.size() < LZSS_INDEX_HEADER
+  || std::memcmp(source.data(), LZSS_INDEX_MAGIC, 4) != 0)
+    throw std::runtime_error("Error: Invalid checkpoint index header");
+
+  CheckpointIndex index;
+  index.size     = read32(source.data() + 4);
+  index.interval = read32(source.data() + 8);
+
+  // the records must fit and agree with the sizes
+  const size_t count = read32(source.data() + 12);
+  if(index.interval == 0
+  || count != std::max<size_t>((index.size + index.interval - 1)
+                               / index.interval, 1)
+  || source.size() != LZSS_INDEX_HEADER + count * LZSS_INDEX_RECORD)
+    throw std::runtime_error("Error: Invalid checkpoint index header");
+
+  const uint8_t *record = source.data() + LZSS_INDEX_HEADER;
+  for(size_t i = 0; i < count; ++i, record += LZSS_INDEX_RECORD)
+  {
+    Checkpoint checkpoint;
+    checkpoint.output    = i * index.interval;
+    checkpoint.source    = read32(record + 0);
+    checkpoint.remaining = read32(record + 4);
+    checkpoint.disp      = read32(record + 8);
+    checkpoint.flags     = record[12];
+    checkpoint.mask      = record[13];
+    checkpoint.window.assign(record + 16, record + LZSS_INDEX_RECORD);
+
+    if(checkpoint.disp > checkpoint.output
+    || checkpoint.remaining > index.size - checkpoint.output
+    || (checkpoint.mask & (checkpoint.mask - 1)) != 0)
+      throw std::runtime_error("Error: Invalid checkpoint index");
+
+    index.checkpoints.push_back(std::move(checkpoint));
+  }
 
-      // get best match starting at the next byte
-      find_best_match(source, it+1, std::min(len-1, max_len), max_disp, vram,
-                      skip_len);
+  return index;
+}
 
-      // check if the match is too small to compress
-      if(skip_len < 3)
-        skip_len = 1;
+/** @brief Whether a buffer is a segmented container
+ *  @param[in] source Source buffer
+ *  @returns Whether the container magic is present
+ */
+bool
+is_container(const Buffer &source)
+{
+  return source.size() >= LZSS_CONTAINER_HEADER
+      && std::memcmp(source.data(), LZSS_CONTAINER_MAGIC, 4) == 0;
+}
 
-      // get best match for data following the current compressed chunk
-      find_best_match(source, it+tmplen, std::min(len-tmplen, max_len),
-                      max_disp, vram, next_len);
+/** @brief Segmented container compression
+ *  @param[in] source       Source buffer
+ *  @param[in] mode         LZ mode
+ *  @param[in] vram         VRAM-safe
+ *  @param[in] segment_size Uncompressed bytes per segment
+ *  @param[in] options      Encoder options
+ *  @returns Container buffer
+ */
+Buffer
+container_encode(const Buffer &source, LZSS_t mode, bool vram,
+                 size_t segment_size, const EncodeOptions &options)
+{
+  if(segment_size == 0 || segment_size > LZSS_MAX_ENCODE_LEN)
+    throw std::runtime_error("Error: Invalid segment size");
 
-      // check if the match is too small to compress
-      if(next_len < 3)
-        next_len = 1;
+  const size_t size  = source.size();
+  const size_t count = (size + segment_size - 1) / segment_size;
 
-      // if compressing this chunk and the next chunk is less valuable than
-      // skipping this byte and starting compression at the next byte, mark
-      // this byte as being needed to copy
-      if(tmplen + next_len <= skip_len + 1)
-        tmplen = 1;
-    }
+  // encode the segments one per thread; each one stands alone
+  const size_t threads = std::max<size_t>(options.threads, 1);
+  EncodeOptions local = options;
+  local.threads = std::max<size_t>(threads / std::max<size_t>(count, 1), 1);
 
-    if(tmplen < 3)
+  std::vector<Buffer> segments(count);
+  std::exception_ptr  error;
+  std::atomic_flag    failed = ATOMIC_FLAG_INIT;
+  parallel_for(count, threads, [&](size_t i)
+  {
+    try
     {
-      // this is a copy chunk; append this byte to the output buffer
-      result.push_back(*it);
-
-      // only one byte is copied
-      tmplen = 1;
+      const size_t first = i * segment_size;
+      const size_t last  = std::min(first + segment_size, size);
+      segments[i] = lzss_encode(Buffer(source.begin() + first,
+                                       source.begin() + last),
+                                mode, vram, local);
     }
-    else if(mode == LZ10)
+    catch(...)
     {
-      // mark this chunk as compressed
-      assert(code_pos < result.size());
-      result[code_pos] |= (1 << shift);
-
-      // encode the displacement and length
-      size_t disp = it - tmp - 1;
-      assert(tmplen-3 <= 0xF);
-      assert(disp <= 0xFFF);
-      result.push_back(((tmplen-3) << 4) | (disp >> 8));
-      result.push_back(disp);
+      if(!failed.test_and_set())
+        error = std::current_exception();
     }
-    else if(tmplen <= 0x10)
-    {
-      // mark this chunk as compressed
-      assert(code_pos < result.size());
-      result[code_pos] |= (1 << shift);
+  });
+
+  if(error)
+    std::rethrow_exception(error);
+
+  // header, then the offset of every segment and of the end
+  Buffer result(LZSS_CONTAINER_HEADER + 4 * (count + 1));
+  std::memcpy(result.data(), LZSS_CONTAINER_MAGIC, 4);
+  write32(result.data() + 4,  size);
+  write32(result.data() + 8,  segment_size);
+  write32(result.data() + 12, count);
+  for(size_t i = 0; i <= count; ++i)
+  {
+    write32(result.data() + LZSS_CONTAINER_HEADER + 4 * i, result.size());
+    if(i < count)
+      result.insert(result.end(), segments[i].begin(), segments[i].end());
+  }
 
-      // encode the displacement and length
-      size_t disp = it - tmp - 1;
-      assert(tmplen > 2);
-      assert(tmplen-1 <= 0xF);
-      assert(disp <= 0xFFF);
-      result.push_back(((tmplen-1) << 4) | (disp >> 8));
-      result.push_back(disp);
-    }
-    else if(tmplen <= 0x110)
-    {
-      // mark this chunk as compressed
-      assert(code_pos < result.size());
-      result[code_pos] |= (1 << shift);
+  return result;
+}
 
-      // encode the displacement and length
-      size_t disp = it - tmp - 1;
-      assert(tmplen >= 0x11);
-      assert(tmplen-0x11 <= 0xFF);
-      assert(disp <= 0xFFF);
-      result.push_back((tmplen-0x11) >> 4);
-      result.push_back(((tmplen-0x11) << 4) | (disp >> 8));
-      result.push_back(disp);
-    }
-    else
-    {
-      // mark this chunk as compressed
-      assert(code_pos < result.size());
-      result[code_pos] |= (1 << shift);
+/** @brief Number of segments in a container
+ *  @param[in] source Container buffer
+ *  @returns Number of segments
+ */
+size_t
+container_segments(const Buffer &source)
+{
+  if(!is_container(source))
+    throw std::runtime_error("Error: Invalid container header");
 
-      // encode the displacement and length
-      size_t disp = it - tmp - 1;
-      assert(tmplen >= 0x111);
-      assert(tmplen-0x111 <= 0xFFFF);
-      assert(disp <= 0xFFF);
-      result.push_back((1 << 4) | (tmplen-0x111) >> 12);
-      result.push_back(((tmplen-0x111) >> 4));
-      result.push_back(((tmplen-0x111) << 4) | (disp >> 8));
-      result.push_back(disp);
-    }
+  const size_t size         = read32(source.data() + 4);
+  const size_t segment_size = read32(source.data() + 8);
+  const size_t count        = read32(source.data() + 12);
 
-    // advance input buffer
-    it += tmplen;
-  }
+  // the index must fit and agree with the sizes
+  if(segment_size == 0
+  || count != (size + segment_size - 1) / segment_size
+  || source.size() < LZSS_CONTAINER_HEADER + 4 * (count + 1))
+    throw std::runtime_error("Error: Invalid container header");
 
-  // pad the output buffer to 4 bytes
-  if(result.size() & 0x3)
-    result.resize((result.size()+3) & ~0x3);
+  const uint8_t *index = source.data() + LZSS_CONTAINER_HEADER;
 
-  // return the output data
-  return result;
+  size_t prev = LZSS_CONTAINER_HEADER + 4 * (count + 1);
+  for(size_t i = 0; i <= count; ++i)
+  {
+    const size_t offset = read32(index + 4 * i);
+    if(offset < prev || offset > source.size())
+      throw std::runtime_error("Error: Invalid container index");
+    prev = offset;
+  }
+
+  return count;
 }
 
-/** @brief LZ10 compression
- *  @param[in] source Source buffer
- *  @param[in] vram   VRAM-safe
- *  @returns Compressed buffer
+/** @brief Export a container segment as a standalone stream
+ *  @param[in] source Container buffer
+ *  @param[in] index  Segment index
+ *  @returns LZ10/LZ11 compressed buffer, as accepted by the GBA BIOS
  */
 Buffer
-lz10_encode(const Buffer &source, bool vram)
+container_export_segment(const Buffer &source, size_t index)
 {
-  return lzss_encode(source, LZ10, vram);
+  if(index >= container_segments(source))
+    throw std::runtime_error("Error: Invalid segment index");
+
+  const uint8_t *offsets = source.data() + LZSS_CONTAINER_HEADER;
+
+  const size_t first = read32(offsets + 4 * index);
+  const size_t last  = read32(offsets + 4 * (index + 1));
+  return Buffer(source.begin() + first, source.begin() + last);
 }
 
-/** @brief LZ11 compression
- *  @param[in] source Source buffer
+/** @brief Decompress one container segment
+ *  @param[in] source Container buffer
+ *  @param[in] index  Segment index
  *  @param[in] vram   VRAM-safe
- *  @returns Compressed buffer
+ *  @returns Decompressed segment
  */
 Buffer
-lz11_encode(const Buffer &source, bool vram)
+container_decode_segment(const Buffer &source, size_t index, bool vram)
 {
-  return lzss_encode(source, LZ11, vram);
+  const Buffer segment = container_export_segment(source, index);
+
+  Buffer result(decoded_size(segment));
+  lzss_decode(segment.data(), segment.size(), result.data(), result.size(),
+              vram);
+
+  return result;
 }
 
-/** @brief LZ10 Decompression
- *  @param[in] source Source buffer
- *  @param[in] vram   VRAM-safe
+/** @brief Segmented container decompression
+ *  @param[in] source  Container buffer
+ *  @param[in] vram    VRAM-safe
+ *  @param[in] threads Number of threads
  *  @returns Decompressed buffer
  */
 Buffer
-lz10_decode(const Buffer &source, bool vram)
+container_decode(const Buffer &source, bool vram, size_t threads)
 {
-  if(source.size() < 4 || source[0] != LZ10)
-    throw std::runtime_error("Error: Invalid LZ10 header");
-
-  size_t size = source[1] | (source[2] << 8) | (source[3] << 16);
+  const size_t count = container_segments(source);
 
-  bool printed_error = false;
-  bool printed_vram_error = false;
-
-  auto    src   = source.cbegin() + 4;
-  uint8_t flags = 0;
-  uint8_t mask  = 0;
+  const size_t size         = read32(source.data() + 4);
+  const size_t segment_size = read32(source.data() + 8);
 
-  Buffer result;
+  const uint8_t *index = source.data() + LZSS_CONTAINER_HEADER;
 
-  while(size > 0)
+  // every segment decodes straight into its slice of the output
+  Buffer result(size);
+  std::exception_ptr error;
+  std::atomic_flag   failed = ATOMIC_FLAG_INIT;
+  parallel_for(count, threads, [&](size_t i)
   {
-    if(mask == 0)
-    {
-      // read in the flags data
-      // from bit 7 to bit 0:
-      //     0: raw byte
-      //     1: compressed block
-      flags = *src++;
-      mask  = 0x80;
-    }
-
-    if(flags & mask) // compressed block
+    try
     {
-      size_t len  = (((*src) & 0xF0) >> 4) + 3;
-      size_t disp = ((*src++) & 0x0F) << 8;
-      disp |= *src++;
-      ++disp;
-
-      if(len > size)
-      {
-        if(!printed_error)
-        {
-          std::fprintf(stderr, "Warning: Badly encoded LZ10 stream; compressed "
-                       "block exceeds output length specified by header. "
-                       "Truncating output.\n");
-          printed_error = true;
-        }
-
-        // truncate output
-        len = size;
-      }
-
-      if(result.size() < disp)
-        throw std::runtime_error("Error: Badly encoded LZ10 stream; encoded "
-                                 "displacement causes read prior to start of "
-                                 "output buffer.");
-
-      if(vram && !printed_vram_error)
-      {
-        if(disp == 1)
-        {
-          std::fprintf(stderr, "Warning: LZ10 stream is not vram safe.\n");
-          printed_vram_error = true;
-        }
-      }
+      const size_t first  = read32(index + 4 * i);
+      const size_t last   = read32(index + 4 * (i + 1));
+      const size_t expect = std::min(segment_size, size - i * segment_size);
 
-      size -= len;
+      if(decoded_size(source.data() + first, last - first) != expect)
+        throw std::runtime_error("Error: Invalid container segment");
 
-      // for len, copy data from the displacement
-      // to the current buffer position
-      while(len-- > 0)
-        result.push_back(*(std::end(result)-disp));
+      lzss_decode(source.data() + first, last - first,
+                  result.data() + i * segment_size, expect, vram);
     }
-    else // uncompressed block
+    catch(...)
     {
-      // copy a raw byte from the input to the output
-      result.push_back(*src++);
-      --size;
+      if(!failed.test_and_set())
+        error = std::current_exception();
     }
+  });
 
-    mask >>= 1;
-  }
+  if(error)
+    std::rethrow_exception(error);
 
   return result;
 }
 
-/** @brief LZ11 Decompression
+/** @brief LZ10 Decompression
  *  @param[in] source Source buffer
  *  @param[in] vram   VRAM-safe
  *  @returns Decompressed buffer
  */
 Buffer
-lz11_decode(const Buffer &source, bool vram)
+lz10_decode(const Buffer &source, bool vram)
 {
-  if(source.size() < 4 || source[0] != LZ11)
-    throw std::runtime_error("Error: Invalid LZ11 header");
-
-  size_t size = source[1] | (source[2] << 8) | (source[3] << 16);
-
-  bool printed_error = false;
-  bool printed_vram_error = false;
-
-  auto    src   = source.cbegin() + 4;
-  uint8_t flags = 0;
-  uint8_t mask  = 0;
-
-  Buffer result;
-
-  while(size > 0)
-  {
-    if(mask == 0)
-    {
-      // read in the flags data
-      // from bit 7 to bit 0:
-      //     0: raw byte
-      //     1: compressed block
-      flags = *src++;
-      mask  = 0x80;
-    }
-
-    if(flags & mask) // compressed block
-    {
-      size_t len;
-      switch((*src) >> 4)
-      {
-        case 0: // extended block
-          len   = (*src++) << 4;
-          len  |= ((*src) >> 4);
-          len  += 0x11;
-          break;
+  if(is_container(source))
+    return container_decode(source, vram, std::thread::hardware_concurrency());
 
-        case 1: // extra extended block
-          len   = ((*src++) & 0x0F) << 12;
-          len  |= (*src++) << 4;
-          len  |= ((*src) >> 4);
-          len  += 0x111;
-          break;
-
-        default: // normal block
-          len   = ((*src) >> 4) + 1;
-          break;
-      }
-
-      size_t disp = ((*src++) & 0x0F) << 8;
-      disp |= *src++;
-      ++disp;
-
-      if(len > size)
-      {
-        if(!printed_error)
-        {
-          std::fprintf(stderr, "Warning: Badly encoded LZ11 stream; compressed "
-                       "block exceeds output length specified by header. "
-                       "Truncating output.\n");
-          printed_error = true;
-        }
-
-        // truncate output
-        len = size;
-      }
+  if(source.size() < 4 || source[0] != LZ10)
+    throw std::runtime_error("Error: Invalid LZ10 header");
 
-      if(result.size() < disp)
-        throw std::runtime_error("Error: Badly encoded LZ11 stream; encoded "
-                                 "displacement causes read prior to start of "
-                                 "output buffer.");
+  Buffer result(decoded_size(source));
+  lzss_decode(source.data(), source.size(), result.data(), result.size(), vram);
 
-      if(vram && !printed_vram_error)
-      {
-        if(disp == 1)
-        {
-          std::fprintf(stderr, "Warning: LZ10 stream is not vram safe.\n");
-          printed_vram_error = true;
-        }
-      }
+  return result;
+}
 
-      size -= len;
+/** @brief LZ11 Decompression
+ *  @param[in] source Source buffer
+ *  @param[in] vram   VRAM-safe
+ *  @returns Decompressed buffer
+ */
+Buffer
+lz11_decode(const Buffer &source, bool vram)
+{
+  if(is_container(source))
+    return container_decode(source, vram, std::thread::hardware_concurrency());
 
-      // for len, copy data from the displacement
-      // to the current buffer position
-      while(len-- > 0)
-        result.push_back(*(std::end(result)-disp));
-    }
-    else // uncompressed block
-    {
-      // copy a raw byte from the input to the output
-      result.push_back(*src++);
-      --size;
-    }
+  if(source.size() < 4 || source[0] != LZ11)
+    throw std::runtime_error("Error: Invalid LZ11 header");
 
-    mask >>= 1;
-  }
+  Buffer result(decoded_size(source));
+  lzss_decode(source.data(), source.size(), result.data(), result.size(), vram);
 
   return result;
 }
@@ -582,16 +3870,17 @@ Buffer read_file(FILE *fp, size_t limit)
 
 /** @brief Write output file
  *  @param[in] fp    Output file stream
- *  @param[in] limit Maximum file size to write
+ *  @param[in] data  Data to write
+ *  @param[in] len   Data length
  *  @returns Whether successfully written
  */
-bool write_file(FILE *fp, const Buffer &buffer)
+bool write_file(FILE *fp, const uint8_t *data, size_t len)
 {
-  auto it = std::begin(buffer);
-  while(it < std::end(buffer))
+  auto it = data;
+  while(it < data + len)
   {
     // write to file
-    ssize_t rc = std::fwrite(&*it, 1, std::end(buffer) - it, fp);
+    ssize_t rc = std::fwrite(it, 1, data + len - it, fp);
     if(rc <= 0)
       return false;
 
@@ -601,4 +3890,14 @@ bool write_file(FILE *fp, const Buffer &buffer)
   return true;
 }
 
+/** @brief Write output file
+ *  @param[in] fp    Output file stream
+ *  @param[in] limit Maximum file size to write
+ *  @returns Whether successfully written
+ */
+bool write_file(FILE *fp, const Buffer &buffer)
+{
+  return write_file(fp, buffer.data(), buffer.size());
+}
+
 }
\ No newline at end of file
@@ -28,12 +28,18 @@
  */
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cstdint>
+#include <exception>
+#include <memory>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <vector>
 #include <getopt.h>
 #include <libgen.h>
@@ -50,6 +56,39 @@ namespace gbalzss
  */
 #define LZSS_MAX_DECODE_LEN 0x01B00003
 
+/** @brief GBA VRAM size */
+#define LZSS_VRAM_SIZE 0x00018000
+
+/** @brief Segmented container magic */
+#define LZSS_CONTAINER_MAGIC "LZSC"
+
+/** @brief Segmented container header size
+ *
+ *  The magic, then the uncompressed size, the uncompressed segment size and
+ *  the number of segments as little-endian 32-bit values. The header is
+ *  followed by the offset of every segment and of the end of the container,
+ *  then the segments, each a complete LZ10/LZ11 stream.
+ */
+#define LZSS_CONTAINER_HEADER 16
+
+/** @brief Checkpoint index magic */
+#define LZSS_INDEX_MAGIC "LZSI"
+
+/** @brief Checkpoint index header size
+ *
+ *  The magic, then the uncompressed size, the checkpoint interval and the
+ *  number of checkpoints as little-endian 32-bit values.
+ */
+#define LZSS_INDEX_HEADER 16
+
+/** @brief Checkpoint index record size
+ *
+ *  The compressed offset, the bytes left in the match in progress and its
+ *  displacement as little-endian 32-bit values, the flag byte, the flag
+ *  mask, two bytes of padding, then the 4096-byte history ring.
+ */
+#define LZSS_INDEX_RECORD (16 + 4096)
+
 /** @brief LZ10 maximum match length */
 #define LZ10_MAX_LEN  18
 
@@ -69,9 +108,83 @@ enum LZSS_t
   LZ11 = 0x11, ///< LZ11 compression
 };
 
+/** @brief Match finder backend */
+enum LZSS_match_t
+{
+  MATCH_LINEAR,     ///< Exhaustive backward scan of the window
+  MATCH_HASH_CHAIN, ///< Hash chains over 3-byte prefixes
+  MATCH_SUFFIX,     ///< Windowed suffix array (exhaustive)
+};
+
+/** @brief Token parse strategy */
+enum LZSS_parse_t
+{
+  PARSE_LAZY,    ///< Greedy with one step of lazy evaluation
+  PARSE_OPTIMAL, ///< Smallest output (shortest path)
+};
+
+/** @brief Encoder objective */
+enum LZSS_objective_t
+{
+  OBJECTIVE_SIZE,   ///< Smallest output
+  OBJECTIVE_CYCLES, ///< Fastest BIOS decode within the size budget
+};
+
 /** @brief Buffer object */
 typedef std::vector<uint8_t> Buffer;
 
+/** @brief Decode outcome */
+enum LZSS_status_t
+{
+  STATUS_OK,               ///< Stream decoded or validated
+  STATUS_BAD_HEADER,       ///< Not an LZ10/LZ11 header
+  STATUS_OUTPUT_TOO_SMALL, ///< Output region smaller than the header size
+  STATUS_TRUNCATED,        ///< Compressed data ends before the output
+  STATUS_BAD_DISPLACEMENT, ///< Displacement reaches before the output
+  STATUS_OVERRUN,          ///< Block exceeds the header size (validation)
+};
+
+/** @brief Encoder options */
+struct EncodeOptions
+{
+  LZSS_match_t     match       = MATCH_HASH_CHAIN; ///< Match finder backend
+  size_t           max_chain   = 0;                ///< Hash chain depth limit
+                                                   ///< (0 for unlimited)
+  LZSS_parse_t     parse       = PARSE_LAZY;       ///< Token parse strategy
+  size_t           threads     = 1;                ///< Encoder threads
+  bool             segmented   = false;            ///< Encode independent
+                                                   ///< segments per thread
+                                                   ///< instead of searching
+                                                   ///< in parallel (always
+                                                   ///< for the lazy parse)
+  bool             runs        = true;             ///< Encode runs and 2-
+                                                   ///< and 4-byte repeats
+                                                   ///< that reach the
+                                                   ///< length limit without
+                                                   ///< a window search
+  bool             fast_runs   = false;            ///< Also take any long
+                                                   ///< run without a window
+                                                   ///< search (faster, may
+                                                   ///< miss longer matches)
+  LZSS_objective_t objective   = OBJECTIVE_SIZE;   ///< Encoder objective
+  size_t           size_budget = 0;                ///< Maximum output length
+                                                   ///< for OBJECTIVE_CYCLES
+                                                   ///< (0 for unlimited)
+};
+
+/** @brief Length of the common prefix of two strings
+ *
+ *  Compares 32 or 16 bytes per step with AVX2 or SSE2 when the CPU supports
+ *  it, otherwise 8 bytes per step; the kernel is chosen at runtime.
+ *
+ *  @param[in] a   First string
+ *  @param[in] b   Second string
+ *  @param[in] len Maximum length to compare
+ *  @returns Length of common prefix
+ */
+size_t
+match_length(const uint8_t *a, const uint8_t *b, size_t len);
+
 /** @brief Find last instance of a byte in a buffer
  *  @param[in] first Beginning of buffer
  *  @param[in] last  End of buffer
@@ -98,6 +211,91 @@ Buffer::const_iterator
 find_best_match(const Buffer &source, Buffer::const_iterator it, size_t len,
                 size_t max_disp, bool vram, size_t &outlen);
 
+/** @brief Hash chain match finder
+ *
+ *  Every position of the source buffer is linked to the previous position
+ *  sharing the same 3-byte prefix (the minimum useful match length), so a
+ *  search only visits candidates that can actually produce a match, nearest
+ *  first. With an unlimited chain depth the result is identical to
+ *  find_best_match() for every match of length 3 or more.
+ */
+class HashChain
+{
+public:
+  /** @brief Constructor
+   *  @param[in] source    Source buffer
+   *  @param[in] max_chain Maximum candidates examined per search
+   *                       (0 for unlimited)
+   */
+  HashChain(const Buffer &source, size_t max_chain);
+
+  /** @brief Find best buffer match
+   *  @param[in]  it       Position in source buffer
+   *  @param[in]  len      Maximum length to match
+   *  @param[in]  max_disp Maximum displacement
+   *  @param[in]  vram     VRAM-safe
+   *  @param[out] outlen   Length of match
+   *  @returns Iterator to best match
+   *  @retval source.cend() for no match
+   */
+  Buffer::const_iterator
+  find_best_match(Buffer::const_iterator it, size_t len, size_t max_disp,
+                  bool vram, size_t &outlen) const;
+
+private:
+  const Buffer          &source;   ///< Source buffer
+  size_t                max_chain; ///< Maximum chain depth
+  std::vector<uint32_t> prev;      ///< Previous position with same prefix
+};
+
+/** @brief Windowed suffix array match finder
+ *
+ *  The source is split into blocks; each block is suffix sorted together with
+ *  the window preceding it and the lookahead following it, by as many bytes
+ *  as a match can use and then by position. The positions of the sliding
+ *  window are kept in a tree ordered by suffix rank, so the longest match is
+ *  found next to the current position's rank, and the nearest or farthest
+ *  candidate of that length comes from a range query; the nearest
+ *  full-length match simply ranks just below. Every position costs at most
+ *  O(log n) regardless of match length, and the result is identical to
+ *  find_best_match() for every match of length 3 or more.
+ *
+ *  Unless every match is wanted up front, only a short prefix is sorted and
+ *  a longer match is searched on demand.
+ */
+class SuffixArray
+{
+public:
+  /** @brief Constructor
+   *  @param[in] source    Source buffer
+   *  @param[in] max_len   Maximum match length
+   *  @param[in] max_disp  Maximum displacement
+   *  @param[in] vram      VRAM-safe
+   *  @param[in] threads   Number of threads
+   *  @param[in] complete  Find matches of any length up front
+   */
+  SuffixArray(const Buffer &source, size_t max_len, size_t max_disp,
+              bool vram, size_t threads = 1, bool complete = false);
+
+  /** @brief Find best buffer match
+   *  @param[in]  it     Position in source buffer
+   *  @param[in]  len    Maximum length to match
+   *  @param[out] outlen Length of match
+   *  @returns Iterator to best match
+   *  @retval source.cend() for no match
+   */
+  Buffer::const_iterator
+  find_best_match(Buffer::const_iterator it, size_t len, size_t &outlen) const;
+
+private:
+  const Buffer          &source;   ///< Source buffer
+  size_t                max_disp;  ///< Maximum displacement
+  bool                  vram;      ///< VRAM-safe
+  std::vector<uint32_t> lens;      ///< Best match length at each position
+  std::vector<uint16_t> disps;     ///< Best match displacement at each
+                                   ///< position
+};
+
 /** @brief Output a GBA-style compression header
  *  @param[out] header Output header
  *  @param[in]  type   Compression type
@@ -106,6 +304,40 @@ find_best_match(const Buffer &source, Buffer::const_iterator it, size_t len,
 void
 header(Buffer &buffer, uint8_t type, size_t size);
 
+/** @brief Output a GBA-style compression header
+ *  @param[out] header Output header (4 bytes)
+ *  @param[in]  type   Compression type
+ *  @param[in]  size   Uncompressed data size
+ */
+void
+header(uint8_t *buffer, uint8_t type, size_t size);
+
+/** @brief Worst-case compressed size
+ *
+ *  A buffer of this size always holds the LZ10 or LZ11 encoding of size
+ *  bytes, whatever the options.
+ *
+ *  @param[in] size Uncompressed data size
+ *  @returns Compressed size if every byte is encoded uncompressed
+ */
+size_t
+max_encoded_size(size_t size);
+
+/** @brief Uncompressed size from a compression header
+ *  @param[in] source Compressed data
+ *  @param[in] len    Compressed data length
+ *  @returns Uncompressed data size
+ */
+size_t
+decoded_size(const uint8_t *source, size_t len);
+
+/** @brief Uncompressed size from a compression header
+ *  @param[in] source Compressed buffer
+ *  @returns Uncompressed data size
+ */
+size_t
+decoded_size(const Buffer &source);
+
 /** @brief LZ10/LZ11 compression
  *  @param[in] source Source buffer
  *  @param[in] mode   LZ mode
@@ -115,6 +347,154 @@ header(Buffer &buffer, uint8_t type, size_t size);
 Buffer
 lzss_encode(const Buffer &source, LZSS_t mode, bool vram);
 
+/** @brief LZ10/LZ11 compression
+ *  @param[in] source  Source buffer
+ *  @param[in] mode    LZ mode
+ *  @param[in] vram    VRAM-safe
+ *  @param[in] options Encoder options
+ *  @returns Compressed buffer
+ */
+Buffer
+lzss_encode(const Buffer &source, LZSS_t mode, bool vram,
+            const EncodeOptions &options);
+
+/** @brief LZ10/LZ11 compression into a caller-provided region
+ *
+ *  Nothing is allocated for the output; size dest with max_encoded_size().
+ *
+ *  @param[in]  source   Source buffer
+ *  @param[in]  mode     LZ mode
+ *  @param[in]  vram     VRAM-safe
+ *  @param[out] dest     Output region
+ *  @param[in]  dest_len Output region size
+ *  @param[in]  options  Encoder options
+ *  @returns Compressed length
+ */
+size_t
+lzss_encode(const Buffer &source, LZSS_t mode, bool vram, uint8_t *dest,
+            size_t dest_len, const EncodeOptions &options);
+
+/** @brief Compression with whichever of LZ10 and LZ11 is smaller
+ *
+ *  Both formats are encoded concurrently on two threads. LZ10 is the
+ *  default on a tie since it is cheaper to decode and the GBA BIOS
+ *  supports it.
+ *
+ *  @param[in] source  Source buffer
+ *  @param[in] vram    VRAM-safe
+ *  @param[in] options Encoder options
+ *  @param[in] prefer  Format kept when both are the same size
+ *  @returns Compressed buffer; the header gives the chosen format
+ */
+Buffer
+lzss_encode_auto(const Buffer &source, bool vram, const EncodeOptions &options,
+                 LZSS_t prefer = LZ10);
+
+/** @brief Re-encode an edited source, reusing the previous stream
+ *
+ *  The tokens of the previous stream are reused up to the first changed
+ *  byte. The changed region is encoded again until the first old token
+ *  boundary whose window lies entirely in the unchanged suffix, and the
+ *  tokens from there on are reused too. Only flag bytes are rebuilt, so the
+ *  cost depends on the size of the edit rather than of the source. The
+ *  format is taken from the previous stream. With a size budget the whole
+ *  source is encoded again, since the budget applies to the whole stream.
+ *
+ *  @param[in] old_source Previous source buffer
+ *  @param[in] old_stream Previous compressed buffer
+ *  @param[in] source     Source buffer
+ *  @param[in] vram       VRAM-safe
+ *  @param[in] options    Encoder options
+ *  @returns Compressed buffer
+ */
+Buffer
+lzss_reencode(const Buffer &old_source, const Buffer &old_stream,
+              const Buffer &source, bool vram, const EncodeOptions &options);
+
+/** @brief LZ10/LZ11 compressed size
+ *
+ *  Runs the same parse as lzss_encode() but only counts tokens and flag
+ *  bytes, so no output is produced.
+ *
+ *  @param[in] source Source buffer
+ *  @param[in] mode   LZ mode
+ *  @param[in] vram   VRAM-safe
+ *  @returns Length lzss_encode() would return, including header and padding
+ */
+size_t
+lzss_encoded_size(const Buffer &source, LZSS_t mode, bool vram);
+
+/** @brief LZ10/LZ11 compressed size
+ *  @param[in] source  Source buffer
+ *  @param[in] mode    LZ mode
+ *  @param[in] vram    VRAM-safe
+ *  @param[in] options Encoder options
+ *  @returns Length lzss_encode() would return, including header and padding
+ */
+size_t
+lzss_encoded_size(const Buffer &source, LZSS_t mode, bool vram,
+                  const EncodeOptions &options);
+
+/** @brief Incremental LZ10/LZ11 compression
+ *
+ *  Input is accepted in chunks of any size and encoded a block at a time;
+ *  only the window preceding the current block and the block itself are
+ *  kept, so memory use does not depend on the input size. Compressed bytes
+ *  are handed out as soon as their flag byte is complete. Matches do not
+ *  cross block boundaries, so inputs longer than one block may encode
+ *  slightly larger than with lzss_encode(). A size budget cannot be met one
+ *  block at a time, so options with a size_budget are rejected.
+ *
+ *  If the uncompressed size is not given up front, the header carries size 0
+ *  until the first four output bytes are overwritten with size_header().
+ */
+class StreamEncoder
+{
+public:
+  /** @brief Constructor for an input of unknown size
+   *  @param[in] mode    LZ mode
+   *  @param[in] vram    VRAM-safe
+   *  @param[in] options Encoder options
+   */
+  StreamEncoder(LZSS_t mode, bool vram, const EncodeOptions &options);
+
+  /** @brief Constructor for an input of known size
+   *  @param[in] mode    LZ mode
+   *  @param[in] vram    VRAM-safe
+   *  @param[in] options Encoder options
+   *  @param[in] size    Uncompressed data size
+   */
+  StreamEncoder(LZSS_t mode, bool vram, const EncodeOptions &options,
+                size_t size);
+
+  /** @brief Destructor */
+  ~StreamEncoder();
+
+  /** @brief Compress a chunk of input
+   *  @param[in]  data Input chunk
+   *  @param[in]  len  Input chunk length
+   *  @param[out] out  Compressed output (appended)
+   */
+  void write(const uint8_t *data, size_t len, Buffer &out);
+
+  /** @brief Compress the remaining input and pad the output
+   *  @param[out] out Compressed output (appended)
+   */
+  void finish(Buffer &out);
+
+  /** @brief Final compression header
+   *  @param[out] buffer Output header (4 bytes)
+   */
+  void size_header(uint8_t *buffer) const;
+
+private:
+  struct State;
+
+  std::unique_ptr<State> state; ///< Encoder state
+  size_t                 size;  ///< Expected uncompressed size
+  bool                   known; ///< Whether size was given up front
+};
+
 /** @brief LZ10 compression
  *  @param[in] source Source buffer
  *  @param[in] vram   VRAM-safe
@@ -131,7 +511,291 @@ lz10_encode(const Buffer &source, bool vram);
 Buffer
 lz11_encode(const Buffer &source, bool vram);
 
+/** @brief Estimated BIOS decode cycles
+ *
+ *  A host-side model of LZ77UnCompVram: a fixed cost per flag byte, per
+ *  uncompressed byte and per match, plus a cost per byte copied and per
+ *  halfword stored. OBJECTIVE_CYCLES minimizes the same model.
+ *
+ *  @param[in] source Compressed data
+ *  @param[in] len    Compressed data length
+ *  @returns Estimated cycles
+ */
+size_t
+decode_cycles(const uint8_t *source, size_t len);
+
+/** @brief Estimated BIOS decode cycles
+ *  @param[in] source Compressed buffer
+ *  @returns Estimated cycles
+ */
+size_t
+decode_cycles(const Buffer &source);
+
+/** @brief Outcome of a non-throwing decode or validation */
+struct DecodeResult
+{
+  LZSS_status_t status      = STATUS_OK; ///< Outcome
+  size_t        position    = 0;         ///< Offset of the failing token,
+                                         ///< or just past the last token
+  size_t        size        = 0;         ///< Decompressed bytes produced
+  bool          overrun     = false;     ///< A block was cut to the size
+  bool          vram_unsafe = false;     ///< Displacement 1 seen (vram)
+};
+
+/** @brief LZ10/LZ11 Decompression into a caller-provided region
+ *
+ *  The format is taken from the header. Nothing is allocated; size dest with
+ *  decoded_size(). Bytes of dest past the decompressed length are left
+ *  untouched, so dest may be a slice of a larger image, e.g. a charblock of
+ *  a LZSS_VRAM_SIZE VRAM image assembled from several streams.
+ *
+ *  @param[in]  source   Compressed data
+ *  @param[in]  len      Compressed data length
+ *  @param[out] dest     Output region
+ *  @param[in]  dest_len Output region size
+ *  @param[in]  vram     VRAM-safe
+ *  @returns Decompressed length
+ */
+size_t
+lzss_decode(const uint8_t *source, size_t len, uint8_t *dest, size_t dest_len,
+            bool vram);
+
+/** @brief LZ10/LZ11 Decompression without exceptions or diagnostics
+ *
+ *  Like lzss_decode(), but failures are reported through the status and
+ *  position of the result instead of exceptions, and warnings through its
+ *  flags instead of stderr, so invalid candidates are cheap to reject when
+ *  probing many offsets. lzss_decode() is a wrapper around this.
+ *
+ *  @param[in]  source   Compressed data
+ *  @param[in]  len      Compressed data length
+ *  @param[out] dest     Output region
+ *  @param[in]  dest_len Output region size
+ *  @param[in]  vram     VRAM-safe
+ *  @returns Outcome
+ */
+DecodeResult
+lzss_try_decode(const uint8_t *source, size_t len, uint8_t *dest,
+                size_t dest_len, bool vram);
+
+/** @brief Validate an LZ10/LZ11 stream without decompressing it
+ *
+ *  Checks the header, that every displacement stays inside the output and
+ *  that the tokens produce exactly the size given by the header, without
+ *  writing any output. The returned length excludes the padding after the
+ *  last token, so trailing data such as the rest of a ROM is never counted;
+ *  streams are normally padded up to a multiple of 4 bytes.
+ *
+ *  @param[in] source Compressed data
+ *  @param[in] len    Compressed data length (may extend past the stream)
+ *  @returns Compressed bytes consumed, including the header
+ */
+size_t
+lzss_validate(const uint8_t *source, size_t len);
+
+/** @brief Validate an LZ10/LZ11 stream without exceptions or diagnostics
+ *
+ *  Like lzss_validate(); on success the position of the result is the
+ *  compressed length consumed.
+ *
+ *  @param[in] source Compressed data
+ *  @param[in] len    Compressed data length
+ *  @returns Outcome
+ */
+DecodeResult
+lzss_try_validate(const uint8_t *source, size_t len);
+
+/** @brief LZ10/LZ11 Decompression directly into a file
+ *
+ *  The file is created (or truncated) at the decompressed size and mapped
+ *  into memory, and the stream is decoded into the mapping.
+ *
+ *  @param[in] source Compressed data
+ *  @param[in] len    Compressed data length
+ *  @param[in] path   Output file path
+ *  @param[in] vram   VRAM-safe
+ *  @returns Decompressed length
+ */
+size_t
+lzss_decode_file(const uint8_t *source, size_t len, const char *path,
+                 bool vram);
+
+/** @brief Resumable LZ10/LZ11 decoder
+ *
+ *  Compressed input is fed in chunks of any size and decompressed output is
+ *  drained a few bytes at a time. Besides input that has been written but
+ *  not yet consumed, only the 4096-byte history window, the current flag
+ *  byte and mask and a partially copied match are kept, so memory use does
+ *  not depend on the output size. The format is taken from the header.
+ */
+class StreamDecoder
+{
+public:
+  /** @brief Constructor
+   *  @param[in] vram VRAM-safe
+   */
+  explicit StreamDecoder(bool vram);
+
+  /** @brief Destructor */
+  ~StreamDecoder();
+
+  /** @brief Feed a chunk of compressed input
+   *  @param[in] data Input chunk
+   *  @param[in] len  Input chunk length
+   */
+  void write(const uint8_t *data, size_t len);
+
+  /** @brief Decompress buffered input
+   *  @param[out] dest Output region
+   *  @param[in]  len  Maximum bytes to decompress
+   *  @returns Bytes decompressed; fewer than len when more input is needed
+   *           or the output is complete
+   */
+  size_t read(uint8_t *dest, size_t len);
+
+  /** @brief Uncompressed size
+   *  @returns Size from the header, or 0 until the header has been read
+   */
+  size_t size() const;
+
+  /** @brief Whether the whole output has been decompressed
+   *  @returns Whether the output is complete
+   */
+  bool done() const;
+
+private:
+  struct State;
+
+  std::unique_ptr<State> state; ///< Decoder state
+};
+
+/** @brief Decoder state at a point in a compressed stream */
+struct Checkpoint
+{
+  size_t  output;    ///< Uncompressed offset
+  size_t  source;    ///< Compressed offset of the next unread byte
+  size_t  remaining; ///< Bytes left in the match in progress
+  size_t  disp;      ///< Displacement of the match in progress
+  uint8_t flags;     ///< Current flag byte
+  uint8_t mask;      ///< Current flag mask
+  Buffer  window;    ///< History ring, indexed by uncompressed offset % 4096
+};
+
+/** @brief Random-access checkpoint index over a compressed stream
+ *
+ *  Checkpoint i holds the decoder state after i * interval uncompressed
+ *  bytes, so any range can be decoded starting at most interval bytes
+ *  before it.
+ */
+struct CheckpointIndex
+{
+  size_t                  size;        ///< Uncompressed size
+  size_t                  interval;    ///< Uncompressed bytes per checkpoint
+  std::vector<Checkpoint> checkpoints; ///< Checkpoints
+};
+
+/** @brief Build a checkpoint index over a compressed stream
+ *  @param[in] source   Compressed data
+ *  @param[in] len      Compressed data length
+ *  @param[in] interval Uncompressed bytes between checkpoints
+ *  @returns Checkpoint index
+ */
+CheckpointIndex
+checkpoint_index(const uint8_t *source, size_t len, size_t interval);
+
+/** @brief Decompress part of a stream starting from the nearest checkpoint
+ *
+ *  The range is clipped to the end of the output.
+ *
+ *  @param[in]  source Compressed data
+ *  @param[in]  len    Compressed data length
+ *  @param[in]  index  Checkpoint index for the stream
+ *  @param[in]  first  Uncompressed offset to start at
+ *  @param[out] dest   Output region
+ *  @param[in]  count  Bytes to decompress
+ *  @param[in]  vram   VRAM-safe
+ *  @returns Bytes decompressed
+ */
+size_t
+checkpoint_decode(const uint8_t *source, size_t len,
+                  const CheckpointIndex &index, size_t first, uint8_t *dest,
+                  size_t count, bool vram);
+
+/** @brief Serialize a checkpoint index
+ *  @param[in] index Checkpoint index
+ *  @returns Serialized index
+ */
+Buffer
+checkpoint_export(const CheckpointIndex &index);
+
+/** @brief Deserialize a checkpoint index
+ *  @param[in] source Serialized index
+ *  @returns Checkpoint index
+ */
+CheckpointIndex
+checkpoint_import(const Buffer &source);
+
+/** @brief Whether a buffer is a segmented container
+ *  @param[in] source Source buffer
+ *  @returns Whether the container magic is present
+ */
+bool
+is_container(const Buffer &source);
+
+/** @brief Segmented container compression
+ *
+ *  The source is split into segments that are compressed independently, with
+ *  no matches across segment boundaries, so they can be decoded in parallel
+ *  or one at a time.
+ *
+ *  @param[in] source       Source buffer
+ *  @param[in] mode         LZ mode
+ *  @param[in] vram         VRAM-safe
+ *  @param[in] segment_size Uncompressed bytes per segment
+ *  @param[in] options      Encoder options
+ *  @returns Container buffer
+ */
+Buffer
+container_encode(const Buffer &source, LZSS_t mode, bool vram,
+                 size_t segment_size, const EncodeOptions &options);
+
+/** @brief Number of segments in a container
+ *  @param[in] source Container buffer
+ *  @returns Number of segments
+ */
+size_t
+container_segments(const Buffer &source);
+
+/** @brief Export a container segment as a standalone stream
+ *  @param[in] source Container buffer
+ *  @param[in] index  Segment index
+ *  @returns LZ10/LZ11 compressed buffer, as accepted by the GBA BIOS
+ */
+Buffer
+container_export_segment(const Buffer &source, size_t index);
+
+/** @brief Decompress one container segment
+ *  @param[in] source Container buffer
+ *  @param[in] index  Segment index
+ *  @param[in] vram   VRAM-safe
+ *  @returns Decompressed segment
+ */
+Buffer
+container_decode_segment(const Buffer &source, size_t index, bool vram);
+
+/** @brief Segmented container decompression
+ *  @param[in] source  Container buffer
+ *  @param[in] vram    VRAM-safe
+ *  @param[in] threads Number of threads
+ *  @returns Decompressed buffer
+ */
+Buffer
+container_decode(const Buffer &source, bool vram, size_t threads);
+
 /** @brief LZ10 Decompression
+ *
+ *  A segmented container is decoded too, on all hardware threads.
+ *
  *  @param[in] source Source buffer
  *  @param[in] vram   VRAM-safe
  *  @returns Decompressed buffer
@@ -140,6 +804,9 @@ Buffer
 lz10_decode(const Buffer &source, bool vram);
 
 /** @brief LZ11 Decompression
+ *
+ *  A segmented container is decoded too, on all hardware threads.
+ *
  *  @param[in] source Source buffer
  *  @param[in] vram   VRAM-safe
  *  @returns Decompressed buffer
@@ -154,6 +821,14 @@ lz11_decode(const Buffer &source, bool vram);
  */
 Buffer read_file(FILE *fp, size_t limit);
 
+/** @brief Write output file
+ *  @param[in] fp    Output file stream
+ *  @param[in] data  Data to write
+ *  @param[in] len   Data length
+ *  @returns Whether successfully written
+ */
+bool write_file(FILE *fp, const uint8_t *data, size_t len);
+
 /** @brief Write output file
  *  @param[in] fp    Output file stream
  *  @param[in] limit Maximum file size to write
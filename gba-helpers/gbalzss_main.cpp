@@ -27,6 +27,7 @@
  */
 
 #include "gbalzss.hpp"
+#include <sys/stat.h>
 using namespace gbalzss;
 
 namespace gbalzss
@@ -39,11 +40,38 @@ namespace gbalzss
 void usage(FILE *fp, const char *program)
 {
   std::fprintf(fp,
-    "Usage: %s [-h|--help] [--lz11] [--vram] <d|e> <infile> <outfile>\n"
+    "Usage: %s [-h|--help] [--lz11|--auto] [--vram] [--match <finder>] "
+    "[--chain <depth>] [--parse <strategy>] [--jobs <n>] [--segmented] "
+    "[--no-runs] [--fast-runs] [--objective <goal>] [--budget <bytes>] [--stats] "
+    "[--container <bytes>] [--stream] <d|e> <infile> <outfile>\n"
     "\tOptions:\n"
     "\t\t-h, --help\tShow this help\n"
     "\t\t--lz11    \tCompress using LZ11 instead of LZ10\n"
+    "\t\t--auto    \tCompress using whichever of LZ10 and LZ11 is smaller; "
+    "decompress\n\t\t          \teither, as given by the header\n"
     "\t\t--vram    \tGenerate VRAM-safe output (required by GBA BIOS)\n"
+    "\t\t--match   \tMatch finder: linear, hash (default) or suffix\n"
+    "\t\t--chain   \tLimit hash chain search depth (default 0 = unlimited)\n"
+    "\t\t--parse   \tParse strategy: lazy (default) or optimal\n"
+    "\t\t--jobs    \tEncode on <n> threads (default 1)\n"
+    "\t\t--segmented\tGive each thread its own segment (faster, output may "
+    "differ;\n\t\t          \talways on for the lazy parse)\n"
+    "\t\t--no-runs \tSearch the window for long runs too\n"
+    "\t\t--fast-runs\tTake long runs without a window search (faster on "
+    "long runs,\n\t\t          \toutput may be larger)\n"
+    "\t\t--objective\tEncode for size (default) or cycles (fastest BIOS "
+    "decode)\n"
+    "\t\t--budget  \tMaximum output size for --objective cycles "
+    "(default 0 = none)\n"
+    "\t\t--stats   \tReport compressed size and estimated BIOS decode "
+    "cycles\n"
+    "\t\t--container\tCompress into a container of independent segments of "
+    "<bytes>\n\t\t          \teach (decoded in parallel; not BIOS "
+    "compatible)\n"
+    "\t\t--stream  \tCompress <infile> as it arrives, in bounded memory; "
+    "matches\n\t\t          \tdo not cross 64 KiB blocks, so output may "
+    "be slightly\n\t\t          \tlarger. Output to a pipe is held until "
+    "the end unless\n\t\t          \t<infile> is a regular file\n"
     "\n"
     "\tArguments\n"
     "\t\te         \tCompress <infile> into <outfile>\n"
@@ -58,10 +86,110 @@ const struct option long_options[] =
 {
   { "help",    no_argument, nullptr, 'h', },
   { "lz11",    no_argument, nullptr, '1', },
+  { "auto",    no_argument, nullptr, 'a', },
   { "vram",    no_argument, nullptr, 'v', },
+  { "match",   required_argument, nullptr, 'm', },
+  { "chain",   required_argument, nullptr, 'c', },
+  { "parse",   required_argument, nullptr, 'p', },
+  { "jobs",    required_argument, nullptr, 'j', },
+  { "segmented", no_argument,     nullptr, 's', },
+  { "no-runs", no_argument,       nullptr, 'r', },
+  { "fast-runs", no_argument,     nullptr, 'f', },
+  { "objective", required_argument, nullptr, 'o', },
+  { "budget",  required_argument, nullptr, 'b', },
+  { "stats",   no_argument,       nullptr, 'S', },
+  { "container", required_argument, nullptr, 'C', },
+  { "stream",  no_argument,       nullptr, 'T', },
   { nullptr,   no_argument, nullptr,   0, },
 };
 
+/** @brief Estimated BIOS decode cycles of a stream or container
+ *  @param[in] buffer Compressed buffer
+ *  @returns Estimated cycles, summed over the segments of a container
+ */
+size_t stream_cycles(const Buffer &buffer)
+{
+  if(!is_container(buffer))
+    return decode_cycles(buffer);
+
+  size_t cycles = 0;
+  for(size_t i = 0; i < container_segments(buffer); ++i)
+    cycles += decode_cycles(container_export_segment(buffer, i));
+
+  return cycles;
+}
+
+/** @brief Compress a stream as it arrives
+ *
+ *  The size header is written up front if the input is a regular file,
+ *  patched afterwards if the output is seekable, and otherwise the
+ *  compressed output is held back until the size is known.
+ *
+ *  @param[in] in      Input file stream
+ *  @param[in] out     Output file stream
+ *  @param[in] mode    LZ mode
+ *  @param[in] vram    VRAM-safe
+ *  @param[in] options Encoder options
+ */
+void stream_encode(FILE *in, FILE *out, LZSS_t mode, bool vram,
+                   const EncodeOptions &options)
+{
+  struct stat st;
+  const long offset = std::ftell(in);
+  const bool known  = ::fstat(::fileno(in), &st) == 0 && S_ISREG(st.st_mode)
+                   && offset >= 0;
+
+  std::unique_ptr<StreamEncoder> encoder;
+  if(known)
+    encoder.reset(new StreamEncoder(mode, vram, options, st.st_size - offset));
+  else
+    encoder.reset(new StreamEncoder(mode, vram, options));
+
+  // without the size up front, patch the header afterwards; a pipe cannot be
+  // patched, so hold the output back instead
+  const bool patch = !known && std::fseek(out, 0, SEEK_CUR) == 0;
+  const bool hold  = !known && !patch;
+
+  Buffer buffer;
+  Buffer tmp(4096);
+
+  size_t rc;
+  do
+  {
+    // compress whatever has arrived
+    rc = std::fread(tmp.data(), 1, tmp.size(), in);
+    encoder->write(tmp.data(), rc, buffer);
+
+    if(!hold && !buffer.empty())
+    {
+      if(!write_file(out, buffer))
+        throw std::runtime_error("Error: Failed to write output");
+      buffer.clear();
+    }
+  } while(rc > 0);
+
+  if(std::ferror(in))
+    throw std::runtime_error("Error: Failed to read file");
+
+  encoder->finish(buffer);
+
+  if(hold)
+    encoder->size_header(buffer.data());
+
+  if(!write_file(out, buffer))
+    throw std::runtime_error("Error: Failed to write output");
+
+  if(patch)
+  {
+    // patch the size header
+    uint8_t header[4];
+    encoder->size_header(header);
+    if(std::fseek(out, 0, SEEK_SET) != 0
+    || std::fwrite(header, 1, sizeof(header), out) != sizeof(header))
+      throw std::runtime_error("Error: Failed to write output");
+  }
+}
+
 }
 
 int main(int argc, char *argv[])
@@ -70,7 +198,13 @@ int main(int argc, char *argv[])
   const char *program = ::basename(argv[0]);
 
   bool lz11 = false;
+  bool automatic = false;
   bool vram = false;
+  bool stats = false;
+  bool stream = false;
+  size_t segment_size = 0;
+
+  EncodeOptions options;
 
   // parse options
   int c;
@@ -86,10 +220,127 @@ int main(int argc, char *argv[])
         lz11 = true;
         break;
 
+      case 'a':
+        automatic = true;
+        break;
+
       case 'v':
         vram = true;
         break;
 
+      case 'm':
+        if(std::strcmp(optarg, "linear") == 0)
+          options.match = MATCH_LINEAR;
+        else if(std::strcmp(optarg, "hash") == 0)
+          options.match = MATCH_HASH_CHAIN;
+        else if(std::strcmp(optarg, "suffix") == 0)
+          options.match = MATCH_SUFFIX;
+        else
+        {
+          std::fprintf(stderr, "Error: Invalid match finder '%s'\n", optarg);
+          usage(stderr, program);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'p':
+        if(std::strcmp(optarg, "lazy") == 0)
+          options.parse = PARSE_LAZY;
+        else if(std::strcmp(optarg, "optimal") == 0)
+          options.parse = PARSE_OPTIMAL;
+        else
+        {
+          std::fprintf(stderr, "Error: Invalid parse strategy '%s'\n", optarg);
+          usage(stderr, program);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'j':
+      {
+        char *end;
+        options.threads = std::strtoul(optarg, &end, 0);
+        if(*optarg == '\0' || *end != '\0' || options.threads == 0)
+        {
+          std::fprintf(stderr, "Error: Invalid job count '%s'\n", optarg);
+          usage(stderr, program);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+
+      case 's':
+        options.segmented = true;
+        break;
+
+      case 'r':
+        options.runs = false;
+        break;
+
+      case 'f':
+        options.fast_runs = true;
+        break;
+
+      case 'T':
+        stream = true;
+        break;
+
+      case 'o':
+        if(std::strcmp(optarg, "size") == 0)
+          options.objective = OBJECTIVE_SIZE;
+        else if(std::strcmp(optarg, "cycles") == 0)
+          options.objective = OBJECTIVE_CYCLES;
+        else
+        {
+          std::fprintf(stderr, "Error: Invalid objective '%s'\n", optarg);
+          usage(stderr, program);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'b':
+      {
+        char *end;
+        options.size_budget = std::strtoul(optarg, &end, 0);
+        if(*optarg == '\0' || *end != '\0')
+        {
+          std::fprintf(stderr, "Error: Invalid size budget '%s'\n", optarg);
+          usage(stderr, program);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+
+      case 'S':
+        stats = true;
+        break;
+
+      case 'C':
+      {
+        char *end;
+        segment_size = std::strtoul(optarg, &end, 0);
+        if(*optarg == '\0' || *end != '\0' || segment_size == 0)
+        {
+          std::fprintf(stderr, "Error: Invalid segment size '%s'\n", optarg);
+          usage(stderr, program);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+
+      case 'c':
+      {
+        char *end;
+        options.max_chain = std::strtoul(optarg, &end, 0);
+        if(*optarg == '\0' || *end != '\0')
+        {
+          std::fprintf(stderr, "Error: Invalid chain depth '%s'\n", optarg);
+          usage(stderr, program);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+
       default:
         std::fprintf(stderr, "Error: Invalid option '%c'\n", optopt);
         usage(stderr, program);
@@ -111,6 +362,76 @@ int main(int argc, char *argv[])
   const char *infile = argv[optind++];
   const char *outfile = argv[optind++];
 
+  if(stream && (!encode || automatic || stats || segment_size))
+  {
+    std::fprintf(stderr, "Error: --stream only applies to compression "
+                 "without --auto, --stats or --container\n");
+    usage(stderr, program);
+    return EXIT_FAILURE;
+  }
+
+  // blocks are encoded separately, so neither the cycle objective nor its
+  // size budget can be applied to the whole stream
+  if(stream && (options.size_budget || options.objective == OBJECTIVE_CYCLES))
+  {
+    std::fprintf(stderr, "Error: --stream cannot be combined with "
+                 "--objective cycles or --budget\n");
+    usage(stderr, program);
+    return EXIT_FAILURE;
+  }
+
+  // compress the input as it arrives
+  if(stream)
+  {
+    FILE *in;
+    if(std::strlen(infile) == 1 && *infile == '-')
+      in = stdin;
+    else
+      in = std::fopen(infile, "rb");
+    if(!in)
+    {
+      std::fprintf(stderr, "Error: Failed to open '%s' for reading\n", infile);
+      return EXIT_FAILURE;
+    }
+
+    FILE *fp;
+    if(std::strlen(outfile) == 1 && *outfile == '-')
+      fp = stdout;
+    else
+      fp = std::fopen(outfile, "wb");
+    if(!fp)
+    {
+      std::fprintf(stderr, "Error: Failed to open '%s' for writing\n", outfile);
+      std::fclose(in);
+      return EXIT_FAILURE;
+    }
+
+    try
+    {
+      stream_encode(in, fp, lz11 ? LZ11 : LZ10, vram, options);
+    }
+    catch(const std::runtime_error &e)
+    {
+      std::fprintf(stderr, "%s: %s\n", infile, e.what());
+      std::fclose(in);
+      std::fclose(fp);
+      return EXIT_FAILURE;
+    }
+    catch(...)
+    {
+      std::fprintf(stderr, "%s: Error: unhandled exception\n", infile);
+      std::fclose(in);
+      std::fclose(fp);
+      return EXIT_FAILURE;
+    }
+
+    // close input and output files
+    std::fclose(in);
+    std::fclose(fp);
+
+    return EXIT_SUCCESS;
+  }
+
   // open input file
   FILE *fp;
   if(std::strlen(infile) == 1 && *infile == '-')
@@ -147,12 +468,39 @@ int main(int argc, char *argv[])
   std::fclose(fp);
 
   // process input file
+  const size_t insize = buffer.size();
   try
   {
-    if(encode)
-      buffer = (lz11 ? lz11_encode : lz10_encode)(buffer, vram);
+    if(stats && !encode)
+    {
+      std::fprintf(stderr, "%s: %zu bytes, ~%zu decode cycles\n", infile,
+                   insize, stream_cycles(buffer));
+    }
+
+    if(encode && segment_size)
+    {
+      buffer = container_encode(buffer, lz11 ? LZ11 : LZ10, vram,
+                                segment_size, options);
+    }
+    else if(encode && automatic)
+      buffer = lzss_encode_auto(buffer, vram, options);
+    else if(encode)
+      buffer = lzss_encode(buffer, lz11 ? LZ11 : LZ10, vram, options);
+    else if(automatic && !is_container(buffer))
+    {
+      Buffer result(decoded_size(buffer));
+      lzss_decode(buffer.data(), buffer.size(), result.data(), result.size(),
+                  vram);
+      buffer.swap(result);
+    }
     else
       buffer = (lz11 ? lz11_decode : lz10_decode)(buffer, vram);
+
+    if(stats && encode)
+    {
+      std::fprintf(stderr, "%s: %zu -> %zu bytes, ~%zu decode cycles\n",
+                   infile, insize, buffer.size(), stream_cycles(buffer));
+    }
   }
   catch(const std::runtime_error &e)
   {
@@ -0,0 +1,511 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include "gbalzss.hpp"
+using namespace gbalzss;
+
+static int failures = 0;
+
+static void check(bool ok, const char *what, const char *name) {
+    if (!ok) {
+        printf("FAILED: %s (%s)\n", what, name);
+        ++failures;
+    }
+}
+
+// Small deterministic generator so every run tests the same data
+static uint32_t seed = 1;
+
+static uint32_t next() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+struct Sample {
+    const char *name;
+    Buffer      data;
+};
+
+static Buffer make_text(size_t size) {
+    static const char *words[] = {
+        "link ", "zelda ", "ganon ", "hyrule ", "sword ", "shield ",
+        "the ", "of ", "and ", "triforce ", "\n", "rupee ",
+    };
+
+    Buffer buffer;
+    while (buffer.size() < size) {
+        const char *word = words[next() % 12];
+        buffer.insert(buffer.end(), word, word + strlen(word));
+    }
+    buffer.resize(size);
+    return buffer;
+}
+
+static Buffer make_tiles(size_t size) {
+    // 32-byte 4bpp tiles picked from a small set, with an occasional
+    // pixel changed
+    Buffer tiles(32 * 16);
+    for (size_t i = 0; i < tiles.size(); ++i)
+        tiles[i] = (i / 32) * 0x11 ^ ((i % 4) ? 0 : next() % 3);
+
+    Buffer buffer;
+    while (buffer.size() < size) {
+        const size_t tile = next() % 16;
+        buffer.insert(buffer.end(), tiles.begin() + tile * 32,
+                      tiles.begin() + tile * 32 + 32);
+        if (next() % 4 == 0)
+            buffer.back() ^= next() % 16;
+    }
+    buffer.resize(size);
+    return buffer;
+}
+
+static Buffer make_random(size_t size) {
+    Buffer buffer(size);
+    for (size_t i = 0; i < size; ++i)
+        buffer[i] = next();
+    return buffer;
+}
+
+static Buffer make_runs(size_t size) {
+    // runs and short periodic repeats, some past the LZ10 length limit
+    Buffer buffer;
+    while (buffer.size() < size) {
+        const size_t period = 1 + next() % 4;
+        const size_t count  = 1 + next() % 40;
+        Buffer pattern = make_random(period);
+        for (size_t i = 0; i < count * period; ++i)
+            buffer.push_back(pattern[i % period]);
+        if (next() % 3 == 0)
+            buffer.push_back(next());
+    }
+    buffer.resize(size);
+    return buffer;
+}
+
+static Buffer decode(const Buffer &stream, bool vram) {
+    Buffer output(decoded_size(stream));
+    lzss_decode(stream.data(), stream.size(), output.data(), output.size(),
+                vram);
+    return output;
+}
+
+static void test_roundtrip(const Sample &sample) {
+    const LZSS_match_t matches[] = {
+        MATCH_LINEAR, MATCH_HASH_CHAIN, MATCH_SUFFIX,
+    };
+
+    for (int m = 0; m < 2; ++m)
+    for (int vram = 0; vram < 2; ++vram)
+    for (int parse = 0; parse < 2; ++parse)
+    for (int objective = 0; objective < 3; ++objective)
+    for (int runs = 0; runs < 3; ++runs)
+    for (int jobs = 0; jobs < 3; ++jobs)
+    for (int chain = 0; chain < 2; ++chain) {
+        const LZSS_t mode = m ? LZ11 : LZ10;
+
+        EncodeOptions options;
+        options.parse     = parse ? PARSE_OPTIMAL : PARSE_LAZY;
+        options.objective = objective ? OBJECTIVE_CYCLES : OBJECTIVE_SIZE;
+        options.runs      = runs != 0;
+        options.fast_runs = runs == 2;
+        options.threads   = jobs ? 3 : 1;
+        options.segmented = jobs == 2;
+        options.max_chain = chain ? 4 : 0;
+
+        // a budget the smallest encoding meets
+        if (objective == 2) {
+            EncodeOptions smallest = options;
+            smallest.parse     = PARSE_OPTIMAL;
+            smallest.objective = OBJECTIVE_SIZE;
+            options.size_budget = lzss_encoded_size(sample.data, mode, vram,
+                                                    smallest);
+        }
+
+        // every backend except a depth-limited hash chain is exhaustive,
+        // so they all produce the same stream
+        Buffer expected;
+        for (LZSS_match_t match: matches) {
+            if (chain && match != MATCH_HASH_CHAIN)
+                continue;
+
+            options.match = match;
+            Buffer stream = lzss_encode(sample.data, mode, vram, options);
+
+            check(stream[0] == mode, "encoded header", sample.name);
+            check(decode(stream, vram) == sample.data, "round trip",
+                  sample.name);
+            check(lzss_encoded_size(sample.data, mode, vram, options) ==
+                  stream.size(), "encoded size", sample.name);
+            check(lzss_validate(stream.data(), stream.size()) <=
+                  stream.size(), "validated length", sample.name);
+            if (options.size_budget)
+                check(stream.size() <= options.size_budget, "size budget",
+                      sample.name);
+
+            DecodeResult result = lzss_try_decode(
+                stream.data(), stream.size(), nullptr, 0, vram);
+            check(sample.data.empty() ? result.status == STATUS_OK
+                  : result.status == STATUS_OUTPUT_TOO_SMALL,
+                  "output too small", sample.name);
+
+            if (vram) {
+                Buffer output(sample.data.size());
+                result = lzss_try_decode(stream.data(), stream.size(),
+                                         output.data(), output.size(), true);
+                check(!result.vram_unsafe, "vram safe", sample.name);
+            }
+
+            if (chain)
+                continue;
+
+            if (expected.empty())
+                expected = stream;
+            else
+                check(stream == expected, "same stream from every backend",
+                      sample.name);
+        }
+    }
+
+    // the caller-provided region and automatic selection
+    EncodeOptions options;
+    Buffer lz10 = lzss_encode(sample.data, LZ10, false, options);
+    Buffer lz11 = lzss_encode(sample.data, LZ11, false, options);
+
+    Buffer region(max_encoded_size(sample.data.size()));
+    const size_t len = lzss_encode(sample.data, LZ11, false, region.data(),
+                                   region.size(), options);
+    check(Buffer(region.begin(), region.begin() + len) == lz11,
+          "encode into region", sample.name);
+
+    Buffer automatic = lzss_encode_auto(sample.data, false, options);
+    check(automatic.size() == std::min(lz10.size(), lz11.size()),
+          "automatic selection", sample.name);
+    check(decode(automatic, false) == sample.data, "automatic round trip",
+          sample.name);
+}
+
+static void test_stream_encoder(const Sample &sample) {
+    for (int m = 0; m < 2; ++m)
+    for (int known = 0; known < 2; ++known) {
+        EncodeOptions options;
+        std::unique_ptr<StreamEncoder> encoder;
+        if (known)
+            encoder.reset(new StreamEncoder(m ? LZ11 : LZ10, true, options,
+                                            sample.data.size()));
+        else
+            encoder.reset(new StreamEncoder(m ? LZ11 : LZ10, true, options));
+
+        Buffer stream;
+        for (size_t i = 0; i < sample.data.size(); ) {
+            const size_t len = std::min<size_t>(1 + next() % 5000,
+                                                sample.data.size() - i);
+            encoder->write(&sample.data[i], len, stream);
+            i += len;
+        }
+        encoder->finish(stream);
+        if (!known)
+            encoder->size_header(stream.data());
+
+        check(decode(stream, true) == sample.data, "stream encoder",
+              sample.name);
+    }
+}
+
+static void test_stream_decoder(const Sample &sample, const Buffer &stream) {
+    StreamDecoder decoder(false);
+    Buffer output;
+    size_t fed = 0;
+    uint8_t chunk[300];
+
+    while (!decoder.done()) {
+        const size_t len = decoder.read(chunk, 1 + next() % sizeof(chunk));
+        output.insert(output.end(), chunk, chunk + len);
+
+        if (len == 0) {
+            if (fed == stream.size())
+                break;
+
+            const size_t count = std::min<size_t>(1 + next() % 7,
+                                                  stream.size() - fed);
+            decoder.write(&stream[fed], count);
+            fed += count;
+        }
+    }
+
+    check(decoder.done(), "stream decoder finished", sample.name);
+    check(decoder.size() == sample.data.size(), "stream decoder size",
+          sample.name);
+    check(output == sample.data, "stream decoder output", sample.name);
+}
+
+static void test_truncated(const Sample &sample, const Buffer &stream) {
+    const size_t consumed = lzss_validate(stream.data(), stream.size());
+    Buffer output(sample.data.size());
+
+    for (size_t len = 4; len < consumed; ++len) {
+        DecodeResult result = lzss_try_decode(stream.data(), len,
+                                              output.data(), output.size(),
+                                              false);
+        check(result.status == STATUS_TRUNCATED, "truncated decode",
+              sample.name);
+        check(result.position <= len && result.size < sample.data.size(),
+              "truncated decode position", sample.name);
+        check(std::equal(output.begin(), output.begin() + result.size,
+                         sample.data.begin()),
+              "truncated decode output", sample.name);
+
+        result = lzss_try_validate(stream.data(), len);
+        check(result.status == STATUS_TRUNCATED, "truncated validate",
+              sample.name);
+    }
+
+    for (size_t len = 0; len < 4; ++len) {
+        check(lzss_try_decode(stream.data(), len, output.data(),
+                              output.size(), false).status ==
+              STATUS_BAD_HEADER, "short header", sample.name);
+        check(lzss_try_validate(stream.data(), len).status ==
+              STATUS_BAD_HEADER, "short header", sample.name);
+    }
+
+    DecodeResult result = lzss_try_validate(stream.data(), stream.size());
+    check(result.status == STATUS_OK && result.position == consumed,
+          "validated length", sample.name);
+
+    // a corrupt stream fails with a status or decodes to the wrong data,
+    // but never reads or writes out of bounds
+    for (int i = 0; i < 200 && stream.size() > 4; ++i) {
+        Buffer corrupt = stream;
+        corrupt[4 + next() % (corrupt.size() - 4)] ^= 1 << (next() % 8);
+
+        result = lzss_try_decode(corrupt.data(), corrupt.size(),
+                                 output.data(), output.size(), false);
+        check(result.size <= output.size(), "corrupt decode size",
+              sample.name);
+
+        result = lzss_try_validate(corrupt.data(), corrupt.size());
+        check(result.position <= corrupt.size(), "corrupt validate position",
+              sample.name);
+    }
+}
+
+static void test_statuses() {
+    uint8_t output[16];
+
+    // not an LZ10/LZ11 header
+    const uint8_t header[] = { 0x12, 0x04, 0x00, 0x00, 0x00, 'a', 'b', 'c',
+                               'd' };
+    check(lzss_try_decode(header, sizeof(header), output, sizeof(output),
+                          false).status == STATUS_BAD_HEADER, "bad header",
+          "crafted");
+    check(lzss_try_validate(header, sizeof(header)).status ==
+          STATUS_BAD_HEADER, "bad header", "crafted");
+
+    // a back-reference before the start of the output
+    const uint8_t disp[] = { 0x10, 0x08, 0x00, 0x00, 0x80, 0x00, 0x05 };
+    DecodeResult result = lzss_try_decode(disp, sizeof(disp), output,
+                                          sizeof(output), false);
+    check(result.status == STATUS_BAD_DISPLACEMENT && result.position == 5,
+          "bad displacement", "crafted");
+    result = lzss_try_validate(disp, sizeof(disp));
+    check(result.status == STATUS_BAD_DISPLACEMENT && result.position == 5,
+          "bad displacement", "crafted");
+
+    // a literal and a 5-byte run for a 4-byte output
+    const uint8_t overrun[] = { 0x10, 0x04, 0x00, 0x00, 0x40, 'a', 0x20,
+                                0x00 };
+    result = lzss_try_validate(overrun, sizeof(overrun));
+    check(result.status == STATUS_OVERRUN && result.position == 6,
+          "overrun validate", "crafted");
+    result = lzss_try_decode(overrun, sizeof(overrun), output, 4, true);
+    check(result.status == STATUS_OK && result.overrun && result.size == 4
+          && result.vram_unsafe && memcmp(output, "aaaa", 4) == 0,
+          "overrun decode", "crafted");
+    check(lzss_try_decode(overrun, sizeof(overrun), output, 3,
+                          false).status == STATUS_OUTPUT_TOO_SMALL,
+          "output too small", "crafted");
+
+    bool thrown = false;
+    try {
+        lzss_validate(disp, sizeof(disp));
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    check(thrown, "validate throws", "crafted");
+}
+
+static void test_reencode(const Sample &sample) {
+    if (sample.data.size() < 64)
+        return;
+
+    for (int m = 0; m < 2; ++m)
+    for (int parse = 0; parse < 2; ++parse)
+    for (int edit = 0; edit < 5; ++edit) {
+        EncodeOptions options;
+        options.parse = parse ? PARSE_OPTIMAL : PARSE_LAZY;
+
+        const Buffer old_stream = lzss_encode(sample.data, m ? LZ11 : LZ10,
+                                              true, options);
+
+        Buffer source = sample.data;
+        const size_t at  = next() % source.size();
+        const size_t len = std::min<size_t>(1 + next() % 100,
+                                            source.size() - at);
+        switch (edit) {
+        case 0: // overwrite
+            for (size_t i = at; i < at + len; ++i)
+                source[i] ^= 0x5A;
+            break;
+        case 1: // insert
+            source.insert(source.begin() + at, 17, 'x');
+            break;
+        case 2: // delete
+            source.erase(source.begin() + at, source.begin() + at + len);
+            break;
+        case 3: // append
+            source.insert(source.end(), sample.data.begin(),
+                          sample.data.begin() + len);
+            break;
+        case 4: // truncate
+            source.resize(at);
+            break;
+        }
+
+        Buffer stream = lzss_reencode(sample.data, old_stream, source, true,
+                                      options);
+        check(stream[0] == old_stream[0], "re-encoded format", sample.name);
+        check(decode(stream, true) == source, "re-encoded source",
+              sample.name);
+    }
+}
+
+static void test_checkpoints(const Sample &sample, const Buffer &stream) {
+    const Buffer full = decode(stream, false);
+    const size_t intervals[] = { 1, 7, 4096 };
+
+    for (size_t interval: intervals) {
+        if (interval == 1 && sample.data.size() > 20000)
+            continue;
+
+        const CheckpointIndex built = checkpoint_index(stream.data(),
+                                                       stream.size(),
+                                                       interval);
+        const CheckpointIndex index = checkpoint_import(
+            checkpoint_export(built));
+        check(index.size == built.size && index.interval == built.interval
+              && index.checkpoints.size() == built.checkpoints.size(),
+              "checkpoint import", sample.name);
+
+        for (int i = 0; i < 50; ++i) {
+            const size_t first = next() % (full.size() + 1);
+            const size_t count = next() % 5000;
+
+            Buffer output(count);
+            const size_t len = checkpoint_decode(stream.data(), stream.size(),
+                                                 index, first, output.data(),
+                                                 count, false);
+            check(len == std::min(count, full.size() - first),
+                  "checkpoint range length", sample.name);
+            check(std::equal(output.begin(), output.begin() + len,
+                             full.begin() + first),
+                  "checkpoint range", sample.name);
+        }
+    }
+}
+
+static void test_container(const Sample &sample) {
+    EncodeOptions options;
+    options.threads = 2;
+
+    const size_t segment_size = 4096;
+    Buffer container = container_encode(sample.data, LZ10, true, segment_size,
+                                        options);
+    check(is_container(container), "container magic", sample.name);
+    check(!is_container(lz10_encode(sample.data, true)), "plain stream",
+          sample.name);
+
+    const size_t count = container_segments(container);
+    check(count == (sample.data.size() + segment_size - 1) / segment_size,
+          "container segments", sample.name);
+
+    for (size_t i = 0; i < count; ++i) {
+        const size_t first = i * segment_size;
+        const size_t last  = std::min(sample.data.size(), first + segment_size);
+        const Buffer part(sample.data.begin() + first,
+                          sample.data.begin() + last);
+
+        check(container_decode_segment(container, i, true) == part,
+              "container segment", sample.name);
+        check(decode(container_export_segment(container, i), true) == part,
+              "exported segment", sample.name);
+    }
+
+    check(container_decode(container, true, 3) == sample.data,
+          "container decode", sample.name);
+    check(lz10_decode(container, true) == sample.data,
+          "container through lz10_decode", sample.name);
+}
+
+int main() {
+    printf("Running tests...\n");
+
+    std::vector<Sample> samples = {
+        { "empty",  Buffer() },
+        { "one",    Buffer(1, 0x42) },
+        { "text",   make_text(3000) },
+        { "tiles",  make_tiles(3072) },
+        { "runs",   make_runs(3000) },
+        { "random", make_random(1000) },
+        { "zeros",  Buffer(70000, 0) },
+    };
+
+    printf("Testing encode options...\n");
+    for (const Sample &sample: samples) {
+        if (sample.data.size() <= 20000)
+            test_roundtrip(sample);
+    }
+
+    printf("Testing encoders...\n");
+    Buffer large = make_text(100000);
+    Buffer tiles = make_tiles(100000);
+    large.insert(large.end(), tiles.begin(), tiles.end());
+    samples.push_back({ "large", large });
+
+    for (const Sample &sample: samples)
+        test_stream_encoder(sample);
+
+    printf("Testing decoders...\n");
+    test_statuses();
+    for (const Sample &sample: samples) {
+        for (int m = 0; m < 2; ++m) {
+            const Buffer stream = m ? lz11_encode(sample.data, false)
+                                    : lz10_encode(sample.data, false);
+            check(lzss_try_validate(stream.data(), stream.size()).status ==
+                  STATUS_OK, "validate", sample.name);
+
+            test_stream_decoder(sample, stream);
+            test_checkpoints(sample, stream);
+            if (sample.data.size() <= 20000)
+                test_truncated(sample, stream);
+        }
+    }
+
+    printf("Testing re-encoding...\n");
+    for (const Sample &sample: samples) {
+        if (sample.data.size() <= 20000)
+            test_reencode(sample);
+    }
+
+    printf("Testing containers...\n");
+    for (const Sample &sample: samples)
+        test_container(sample);
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("All tests passed\n");
+    return 0;
+}
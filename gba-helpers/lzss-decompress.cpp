@@ -191,13 +191,43 @@ int main(int argc, char *argv[])
     if (verbose) {
         printf("Processing file\n");
     }
+
+    // Decoded data goes straight into a VRAM-sized image (larger if the
+    // stream needs it), so the tiles are read in place with no extra copy
+    Buffer image;
+    const uint8_t *data = nullptr;
+    size_t size = 0;
     try
     {
         if (encode) {
             buffer = (lz11 ? lz11_encode : lz10_encode)(buffer, vram);
+            data = buffer.data();
+            size = buffer.size();
         }
         else {
-            buffer = (lz11 ? lz11_decode : lz10_decode)(buffer, vram);
+            if (buffer.empty() || buffer[0] != (lz11 ? LZ11 : LZ10)) {
+                throw std::runtime_error(lz11 ? "Error: Invalid LZ11 header"
+                                              : "Error: Invalid LZ10 header");
+            }
+
+            // Check the stream before decoding; this also finds where it
+            // ends within the rest of the ROM. Anything else, such as a
+            // block that overruns the header size, goes to the decoder as
+            // before, which warns and truncates or reports the error.
+            size_t consumed = buffer.size();
+            const DecodeResult checked =
+                lzss_try_validate(buffer.data(), buffer.size());
+            if (checked.status == STATUS_OK) {
+                consumed = checked.position;
+                if (verbose) {
+                    printf("Compressed length: 0x%zx\n", consumed);
+                }
+            }
+
+            image.resize(std::max<size_t>(LZSS_VRAM_SIZE, decoded_size(buffer)));
+            size = lzss_decode(buffer.data(), consumed, image.data(),
+                               image.size(), vram);
+            data = image.data();
         }
     }
     catch(const std::runtime_error &e)
@@ -226,7 +256,7 @@ int main(int argc, char *argv[])
     if (verbose) {
         printf("Writing to output file: %s\n", outfile);
     }
-    if(!write_file(fp, buffer))
+    if(!write_file(fp, data, size))
     {
         std::fprintf(stderr, "Error: Failed to write '%s'\n", outfile);
         std::fclose(fp);
@@ -238,7 +268,7 @@ int main(int argc, char *argv[])
 
     printf("Decoding image...\n");
     std::vector<Pixel> pixels;
-    image_decode_4bpp(buffer, gbahelpers::gray_palette, pixels);
+    image_decode_4bpp(data, size, gbahelpers::gray_palette, pixels);
 
     if (verbose) {
         printf("Converting to bitmap\n");